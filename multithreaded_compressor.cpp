@@ -2,8 +2,16 @@
 // Single-file multithreaded LZ77 chunked compressor + decompressor for Windows
 // Build (MinGW): g++ multithreaded_compressor.cpp -o compressor.exe -std=c++17 -O2 -pthread
 // Build (MSVC): cl /EHsc /std:c++17 multithreaded_compressor.cpp
+// Add -mavx2 (MinGW) or /arch:AVX2 (MSVC) to enable the AVX2 code paths.
 
 #include <bits/stdc++.h>
+#if defined(__SSE2__) || defined(_M_X64) || defined(__AVX2__)
+#include <immintrin.h>
+#define MTC_SSE2 1
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
 using namespace std;
 using u8 = uint8_t;
 using u16 = uint16_t;
@@ -27,14 +35,16 @@ public:
         for (auto &t: workers) if (t.joinable()) t.join();
     }
 
+    // Urgent tasks go to the front of the queue, ahead of everything waiting.
     template<class F>
-    auto enqueue(F&& f) -> future<decltype(f())> {
+    auto enqueue(F&& f, bool urgent = false) -> future<decltype(f())> {
         using R = decltype(f());
         auto task = make_shared<packaged_task<R()>>(forward<F>(f));
         future<R> fut = task->get_future();
         {
             unique_lock<mutex> lk(m);
-            tasks.emplace([task]{ (*task)(); });
+            if (urgent) tasks.emplace_front([task]{ (*task)(); });
+            else tasks.emplace_back([task]{ (*task)(); });
         }
         cv.notify_one();
         return fut;
@@ -42,7 +52,7 @@ public:
 
 private:
     vector<thread> workers;
-    queue<function<void()>> tasks;
+    deque<function<void()>> tasks;
     mutex m;
     condition_variable cv;
     bool stop;
@@ -54,85 +64,2138 @@ private:
                 unique_lock<mutex> lk(m);
                 cv.wait(lk, [this]{ return stop || !tasks.empty(); });
                 if (stop && tasks.empty()) return;
-                job = move(tasks.front()); tasks.pop();
+                job = move(tasks.front()); tasks.pop_front();
             }
             job();
         }
     }
 };
 
+// ---------------------- Match length ----------------------
+// Count of equal leading bytes of a and b, at most limit. This is the hottest
+// loop of every match finder: it compares 32 (AVX2), 16 (SSE2) or 8 bytes per
+// step and locates the first difference with count-trailing-zeros on the
+// compare mask, falling back to bytes only for the last few positions.
+
+static inline unsigned ctz32(u32 v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx; _BitScanForward(&idx, v); return (unsigned)idx;
+#else
+    return (unsigned)__builtin_ctz(v);
+#endif
+}
+
+static inline unsigned ctz64(u64 v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx; _BitScanForward64(&idx, v); return (unsigned)idx;
+#else
+    return (unsigned)__builtin_ctzll(v);
+#endif
+}
+
+// Index of the highest set bit; v must be non-zero.
+static inline unsigned log2_u32(u32 v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long idx; _BitScanReverse(&idx, v); return (unsigned)idx;
+#else
+    return 31u - (unsigned)__builtin_clz(v);
+#endif
+}
+
+static inline u64 load64(const u8* p) { u64 v; memcpy(&v, p, 8); return v; }
+
+static inline size_t match_length(const u8* a, const u8* b, size_t limit) {
+    size_t len = 0;
+#if defined(__AVX2__)
+    while (len + 32 <= limit) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + len));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + len));
+        u32 diff = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff) return len + ctz32(diff);
+        len += 32;
+    }
+#endif
+#if defined(MTC_SSE2)
+    while (len + 16 <= limit) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + len));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + len));
+        u32 diff = ~(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFFu;
+        if (diff) return len + ctz32(diff);
+        len += 16;
+    }
+#endif
+    while (len + 8 <= limit) {
+        u64 diff = load64(a + len) ^ load64(b + len);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        if (diff) return len + ((unsigned)__builtin_clzll(diff) >> 3);
+#else
+        if (diff) return len + (ctz64(diff) >> 3);
+#endif
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len]) ++len;
+    return len;
+}
+
+// ---------------------- Wild copies ----------------------
+// Decoder copies that move whole vectors and may write up to wild_slack
+// bytes past the end of the copy (and read past the end of the source).
+// The decoder fast loops only use them while that much room is left, so
+// the output needs no padding.
+static constexpr size_t wild_slack = 32;
+
+static inline void copy16(u8* dst, const u8* src) {
+#if defined(MTC_SSE2)
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+#else
+    memcpy(dst, src, 16);
+#endif
+}
+
+// Forward copy of len bytes in 16-byte steps; a source before dst must be
+// at least 16 bytes back.
+static inline void wild_copy16(u8* dst, const u8* src, size_t len) {
+    u8* end = dst + len;
+    do { copy16(dst, src); dst += 16; src += 16; } while (dst < end);
+}
+
+// The same with the widest vectors; a source before dst must be at least
+// 32 bytes back.
+static inline void wild_copy(u8* dst, const u8* src, size_t len) {
+#if defined(__AVX2__)
+    u8* end = dst + len;
+    do {
+        _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        dst += 32; src += 32;
+    } while (dst < end);
+#else
+    wild_copy16(dst, src, len);
+#endif
+}
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+// pattern_masks[off][i] = i % off, shuffling the off bytes before a match
+// into a 16-byte vector that repeats them
+static const struct PatternMasks {
+    alignas(16) u8 m[16][16];
+    PatternMasks() {
+        for (int off = 1; off < 16; ++off)
+            for (int i = 0; i < 16; ++i) m[off][i] = u8(i % off);
+    }
+} pattern_masks;
+#endif
+
+// Copies a match of len bytes from off back. Offsets below 16 overlap the
+// bytes being written: the pattern of off bytes is expanded to a vector once
+// and stored in steps of the largest multiple of off that fits in 16 bytes,
+// so every store starts at the same phase of the pattern.
+static inline void wild_match(u8* dst, size_t off, size_t len) {
+    const u8* src = dst - off;
+    if (off >= 32) { wild_copy(dst, src, len); return; }
+    if (off >= 16) { wild_copy16(dst, src, len); return; }
+#if defined(__SSSE3__) || defined(__AVX2__)
+    __m128i pat = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src),
+                                   _mm_load_si128((const __m128i*)pattern_masks.m[off]));
+#else
+    alignas(16) u8 buf[16];
+    for (size_t i = 0, k = 0; i < 16; ++i) { buf[i] = src[k]; if (++k == off) k = 0; }
+#if defined(MTC_SSE2)
+    __m128i pat = _mm_load_si128((const __m128i*)buf);
+#endif
+#endif
+    size_t step = 16 - 16 % off;
+    u8* end = dst + len;
+    do {
+#if defined(MTC_SSE2)
+        _mm_storeu_si128((__m128i*)dst, pat);
+#else
+        memcpy(dst, buf, 16);
+#endif
+        dst += step;
+    } while (dst < end);
+}
+
+// ---------------------- Parameters ----------------------
+enum class MatchFinder { HashChain, BinaryTree };
+enum class Parser { Greedy, Lazy, Lazy2, Optimal };
+
+struct LZ77Params {
+    size_t window_size = 1 << 18; // how far back matches may reach
+    size_t lookahead = UINT32_MAX; // max match length; the token formats take any length
+    size_t search_depth = 64;      // candidates examined per position
+    size_t nice_len = 128;         // matches this long end the search / lookahead
+    size_t opt_block = 1 << 12;    // positions per optimal-parse block
+    size_t opt_passes = 1;         // optimal parses; later ones are priced from the previous one
+    MatchFinder finder = MatchFinder::HashChain;
+    Parser parser = Parser::Greedy;
+};
+
+// Compression levels 1..19: each picks a finder, parser, window and effort.
+// Low levels are shallow greedy hash chains for hot data, the top levels run
+// the optimal parser over a binary tree and a window of up to 64 MB for
+// archives. From -16 the optimal parse is repeated, each pass priced from the
+// entropy statistics of the one before. A window only helps up to the chunk
+// size, so large windows want large chunks.
+static constexpr int min_level = 1, max_level = 19, default_level = 3;
+static constexpr int min_window_log = 10, max_window_log = 30;
+static constexpr int default_long_log = 27; // --long: find repeats up to 128 MB back
+
+static LZ77Params level_params(int level) {
+    struct Spec { MatchFinder finder; Parser parser; int window_log; u32 depth; u32 nice; int block_log; u32 passes; };
+    static const Spec specs[max_level] = {
+        {MatchFinder::HashChain,  Parser::Greedy,  16,    2,  16, 12, 1}, //  1
+        {MatchFinder::HashChain,  Parser::Greedy,  17,    4,  24, 12, 1}, //  2
+        {MatchFinder::HashChain,  Parser::Greedy,  18,    8,  32, 12, 1}, //  3
+        {MatchFinder::HashChain,  Parser::Greedy,  19,   16,  48, 12, 1}, //  4
+        {MatchFinder::HashChain,  Parser::Lazy,    19,    8,  32, 12, 1}, //  5
+        {MatchFinder::HashChain,  Parser::Lazy,    20,   16,  64, 12, 1}, //  6
+        {MatchFinder::HashChain,  Parser::Lazy,    20,   32,  96, 12, 1}, //  7
+        {MatchFinder::HashChain,  Parser::Lazy2,   21,   32, 128, 12, 1}, //  8
+        {MatchFinder::HashChain,  Parser::Lazy2,   21,   64, 128, 12, 1}, //  9
+        {MatchFinder::HashChain,  Parser::Lazy2,   22,  128, 192, 12, 1}, // 10
+        {MatchFinder::BinaryTree, Parser::Lazy2,   22,   32, 192, 12, 1}, // 11
+        {MatchFinder::BinaryTree, Parser::Lazy2,   23,   64, 255, 12, 1}, // 12
+        {MatchFinder::BinaryTree, Parser::Optimal, 23,   16,  32, 12, 1}, // 13
+        {MatchFinder::BinaryTree, Parser::Optimal, 24,   32,  64, 12, 1}, // 14
+        {MatchFinder::BinaryTree, Parser::Optimal, 24,   64,  96, 14, 1}, // 15
+        {MatchFinder::BinaryTree, Parser::Optimal, 25,  128, 128, 13, 2}, // 16
+        {MatchFinder::BinaryTree, Parser::Optimal, 25,  256, 192, 14, 3}, // 17
+        {MatchFinder::BinaryTree, Parser::Optimal, 26,  512, 255, 14, 4}, // 18
+        {MatchFinder::BinaryTree, Parser::Optimal, 26, 1024, 255, 15, 6}, // 19
+    };
+    const Spec& sp = specs[clamp(level, min_level, max_level) - 1];
+    LZ77Params p;
+    p.finder = sp.finder;
+    p.parser = sp.parser;
+    p.window_size = size_t(1) << sp.window_log;
+    p.search_depth = sp.depth;
+    p.nice_len = sp.nice;
+    p.opt_block = size_t(1) << sp.block_log;
+    p.opt_passes = sp.passes;
+    return p;
+}
+
+// ---------------------- Match finders ----------------------
+// Both finders share one interface: reset() over the buffer, find_all(pos, out)
+// listing the matches at pos (and inserting pos), insert(pos) for positions
+// skipped by the parser. search_depth bounds candidates per position.
+
+struct Match {
+    u32 len;
+    u32 off;
+};
+
+// Hash-chain match finder: head[] maps a hash of the next 3 bytes to the most
+// recent position with that hash, chain[] links every position back to the
+// previous one sharing its hash. A search walks at most max_chain links.
+struct HashChainFinder {
+    static constexpr u32 nil = 0xFFFFFFFFu;
+    static constexpr int hash_bits = 16;
+    static constexpr size_t min_match = 3;
+
+    const u8* data = nullptr;
+    size_t n = 0;
+    size_t window_size = 0, lookahead = 0, max_chain = 0, nice_len = 0;
+    vector<u32> head, chain;
+
+    void reset(const u8* d, size_t len, const LZ77Params& p) {
+        data = d; n = len;
+        window_size = p.window_size; lookahead = p.lookahead;
+        max_chain = p.search_depth; nice_len = p.nice_len;
+        head.assign(size_t(1) << hash_bits, nil);
+        chain.assign(n, nil);
+    }
+
+    static u32 hash3(const u8* p) {
+        u32 v = u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16);
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // Link pos into its hash chain without searching.
+    void insert(size_t pos) {
+        if (pos + min_match > n) return;
+        u32 h = hash3(data + pos);
+        chain[pos] = head[h];
+        head[h] = (u32)pos;
+    }
+
+    // Matches for pos within the window, each one longer than the last, so
+    // out.back() is the longest; pos is inserted afterwards.
+    void find_all(size_t pos, vector<Match>& out) {
+        out.clear();
+        if (pos + min_match > n) return;
+        u32 h = hash3(data + pos);
+        size_t limit = min(lookahead, n - pos);
+        size_t best_len = min_match - 1;
+        u32 cand = head[h];
+        for (size_t depth = max_chain; cand != nil && depth > 0; --depth) {
+            size_t dist = pos - cand;
+            if (dist > window_size) break;
+            // skip candidates that cannot beat the current best
+            if (data[cand + best_len] == data[pos + best_len]) {
+                size_t len = match_length(data + cand, data + pos, limit);
+                if (len > best_len) {
+                    best_len = len;
+                    out.push_back({(u32)len, (u32)dist});
+                    if (len == limit || len >= nice_len) break;
+                }
+            }
+            cand = chain[cand];
+        }
+        chain[pos] = head[h];
+        head[h] = (u32)pos;
+    }
+};
+
+// Binary-tree match finder (BT4-style, as in LZMA). Every position is a node in
+// a binary search tree ordered by the bytes that follow it; the root for each
+// 4-byte hash is the most recent position. Descending the tree visits
+// candidates in lexicographic order, so the longest match is found after a
+// logarithmic number of steps even on highly repetitive input. Inserting a
+// position re-roots the tree at it, which is why skipped positions must still
+// go through insert(). Node storage is cyclic over window_size + 1 positions.
+struct BinaryTreeFinder {
+    static constexpr u32 nil = 0xFFFFFFFFu;
+    static constexpr int hash_bits = 18;
+    static constexpr int hash3_bits = 16;
+    static constexpr size_t min_match = 3;
+    static constexpr size_t tree_len = 255; // bytes compared to order the tree
+
+    const u8* data = nullptr;
+    size_t n = 0;
+    size_t window_size = 0, lookahead = 0, max_depth = 0;
+    size_t cyclic_size = 0;
+    vector<u32> head, head3, son;
+
+    void reset(const u8* d, size_t len, const LZ77Params& p) {
+        data = d; n = len;
+        window_size = p.window_size; lookahead = p.lookahead; max_depth = p.search_depth;
+        cyclic_size = max<size_t>(1, min(n, window_size + 1));
+        head.assign(size_t(1) << hash_bits, nil);
+        head3.assign(size_t(1) << hash3_bits, nil);
+        son.assign(2 * cyclic_size, nil);
+    }
+
+    static u32 hash3(const u8* p) {
+        u32 v = u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16);
+        return (v * 2654435761u) >> (32 - hash3_bits);
+    }
+    static u32 hash4(const u8* p) {
+        u32 v = u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    void insert(size_t pos) { update(pos, nullptr); }
+
+    // Suffixes are only ordered on their first tree_len bytes, so a match
+    // reaching that far is extended afterwards, up to the lookahead.
+    void find_all(size_t pos, vector<Match>& out) {
+        out.clear();
+        update(pos, &out);
+        size_t full = min(lookahead, n - pos);
+        if (out.empty() || full <= tree_len || out.back().len < tree_len) return;
+        const u8* cur = data + pos + tree_len;
+        Match& m = out.back();
+        m.len = u32(tree_len + match_length(cur, cur - m.off, full - tree_len));
+    }
+
+private:
+    // Inserts pos into the tree; when out is set also reports matches of increasing length.
+    void update(size_t pos, vector<Match>* out) {
+        size_t best_len = min_match - 1;
+        if (pos + min_match > n) return;
+        const u8* cur = data + pos;
+        size_t limit = min({lookahead, n - pos, tree_len});
+
+        // 3-byte matches are too short to be worth a tree; probe the latest one directly
+        u32 h3 = hash3(cur);
+        u32 c3 = head3[h3];
+        head3[h3] = (u32)pos;
+        if (out && c3 != nil && pos - c3 <= window_size) {
+            size_t len = match_length(data + c3, cur, limit);
+            if (len > best_len) { best_len = len; out->push_back({(u32)len, (u32)(pos - c3)}); }
+        }
+        if (pos + 4 > n) return;
+
+        u32 h = hash4(cur);
+        u32 cand = head[h];
+        head[h] = (u32)pos;
+        u32* ptr1 = &son[2 * (pos % cyclic_size)];     // subtree of smaller suffixes
+        u32* ptr0 = &son[2 * (pos % cyclic_size) + 1]; // subtree of larger suffixes
+        size_t len0 = 0, len1 = 0;
+        for (size_t depth = max_depth; ; --depth) {
+            if (cand == nil || depth == 0 || pos - cand > window_size) {
+                *ptr0 = *ptr1 = nil;
+                break;
+            }
+            u32* pair = &son[2 * (cand % cyclic_size)];
+            const u8* pb = data + cand;
+            // both neighbours share min(len0, len1) bytes with cur already
+            size_t len = min(len0, len1);
+            len += match_length(pb + len, cur + len, limit - len);
+            if (out && len > best_len) { best_len = len; out->push_back({(u32)len, (u32)(pos - cand)}); }
+            if (len == limit) {
+                // cand is a duplicate of cur: cur takes over its children
+                *ptr1 = pair[0];
+                *ptr0 = pair[1];
+                break;
+            }
+            if (pb[len] < cur[len]) {
+                *ptr1 = cand; ptr1 = pair + 1; cand = *ptr1; len1 = len;
+            } else {
+                *ptr0 = cand; ptr0 = pair; cand = *ptr0; len0 = len;
+            }
+        }
+    }
+};
+
+// ---------------------- Varints ----------------------
+// LEB128: 7 bits per byte, least significant group first, high bit set on
+// every byte except the last.
+static void put_varint(vector<u8>& out, u64 v) {
+    while (v >= 0x80) { out.push_back(u8(v) | 0x80); v >>= 7; }
+    out.push_back(u8(v));
+}
+
+static u64 get_varint(const vector<u8>& in, size_t& pos) {
+    u64 v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) throw runtime_error("truncated varint");
+        u8 b = in[pos++];
+        v |= u64(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    throw runtime_error("varint too long");
+}
+
+// Unchecked variant for decoder fast loops: the caller guarantees that
+// max_varint_size bytes can be read at pos.
+static constexpr size_t max_varint_size = 10;
+static u64 get_varint_fast(const u8* in, size_t& pos) {
+    u64 v = 0;
+    for (int shift = 0; ; shift += 7) {
+        u8 b = in[pos++];
+        v |= u64(b & 0x7F) << shift;
+        if (!(b & 0x80) || shift == 63) return v;
+    }
+}
+
+static u32 varint_size(u64 v) {
+    u32 n = 1;
+    while (v >= 0x80) { v >>= 7; ++n; }
+    return n;
+}
+
+// ---------------------- Bit streams ----------------------
+// LSB-first bit packing shared by the entropy coders.
+
+static inline u64 load64le(const u8* p) {
+    u64 v = load64(p);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+struct BitWriter {
+    vector<u8>& out;
+    u64 buf = 0;
+    unsigned cnt = 0;
+
+    void put(u64 v, unsigned n) { // n <= 32
+        buf |= v << cnt;
+        cnt += n;
+        while (cnt >= 8) { out.push_back(u8(buf)); buf >>= 8; cnt -= 8; }
+    }
+    void flush() {
+        if (cnt) out.push_back(u8(buf));
+        buf = 0; cnt = 0;
+    }
+};
+
+struct BitReader {
+    const u8* p;
+    const u8* end;
+    u64 buf = 0;
+    unsigned cnt = 0;
+
+    BitReader(const u8* begin, const u8* stop) : p(begin), end(stop) { refill(); }
+
+    // Tops the buffer up to at least 56 bits while input lasts.
+    void refill() {
+        if (end - p >= 8) {
+            buf |= load64le(p) << cnt;
+            unsigned take = (63 - cnt) >> 3;
+            p += take;
+            cnt += take * 8;
+        } else {
+            while (cnt <= 56 && p < end) { buf |= u64(*p++) << cnt; cnt += 8; }
+        }
+    }
+    u32 peek(unsigned n) const { return u32(buf & ((u64(1) << n) - 1)); }
+    void skip(unsigned n) {
+        if (n > cnt) throw runtime_error("corrupt bitstream");
+        buf >>= n; cnt -= n;
+    }
+    u32 get(unsigned n) { // n <= 32
+        if (cnt < n) refill();
+        u32 v = peek(n);
+        skip(n);
+        return v;
+    }
+};
+
+// ---------------------- Huffman ----------------------
+// Length-limited canonical Huffman codes. Codes are stored bit-reversed so
+// they can be emitted LSB-first and decoded with a single table lookup on
+// the next max_bits bits of the stream.
+struct HuffmanTable {
+    static constexpr unsigned max_bits = 11;
+    struct Entry { u16 sym; u8 len; };
+
+    vector<u8> lens;   // code length per symbol, 0 = unused
+    vector<u16> codes; // bit-reversed canonical codes
+    vector<Entry> dtable;
+
+    // Code lengths from symbol frequencies, flattening the histogram until
+    // the longest code fits max_bits.
+    void build(const vector<u32>& freq) {
+        size_t n = freq.size();
+        while (n && !freq[n - 1]) --n;
+        lens.assign(n, 0);
+        vector<u32> f(freq.begin(), freq.begin() + n);
+        vector<size_t> used;
+        for (size_t s = 0; s < n; ++s) if (f[s]) used.push_back(s);
+        if (used.size() == 1) lens[used[0]] = 1;
+        while (used.size() > 1) {
+            // classic two-smallest merge over a node array; parents record depths
+            struct Node { u64 w; int parent; };
+            vector<Node> nodes;
+            priority_queue<pair<u64, int>, vector<pair<u64, int>>, greater<>> pq;
+            for (size_t s : used) { pq.push({f[s], (int)nodes.size()}); nodes.push_back({f[s], -1}); }
+            while (pq.size() > 1) {
+                auto a = pq.top(); pq.pop();
+                auto b = pq.top(); pq.pop();
+                int id = (int)nodes.size();
+                nodes.push_back({a.first + b.first, -1});
+                nodes[a.second].parent = id;
+                nodes[b.second].parent = id;
+                pq.push({a.first + b.first, id});
+            }
+            unsigned longest = 0;
+            for (size_t k = 0; k < used.size(); ++k) {
+                unsigned depth = 0;
+                for (int at = (int)k; nodes[at].parent >= 0; at = nodes[at].parent) ++depth;
+                lens[used[k]] = (u8)depth;
+                longest = max(longest, depth);
+            }
+            if (longest <= max_bits) break;
+            for (size_t s : used) f[s] = max<u32>(1, f[s] >> 1);
+        }
+        assign_codes();
+    }
+
+    // Table: varint symbol count, then code lengths packed two per byte.
+    void write(vector<u8>& out) const {
+        put_varint(out, lens.size());
+        for (size_t s = 0; s < lens.size(); s += 2)
+            out.push_back(u8(lens[s] | ((s + 1 < lens.size() ? lens[s + 1] : 0) << 4)));
+    }
+
+    void read(const vector<u8>& in, size_t& pos, size_t alphabet) {
+        u64 n = get_varint(in, pos);
+        if (n > alphabet || (n + 1) / 2 > in.size() - pos) throw runtime_error("corrupt huffman table");
+        lens.assign((size_t)n, 0);
+        for (size_t s = 0; s < n; ++s) {
+            lens[s] = (in[pos + s / 2] >> ((s & 1) * 4)) & 15;
+            if (lens[s] > max_bits) throw runtime_error("corrupt huffman table");
+        }
+        pos += (size_t)(n + 1) / 2;
+        assign_codes();
+        build_decoder();
+    }
+
+    void encode(BitWriter& bw, u32 sym) const { bw.put(codes[sym], lens[sym]); }
+
+    u32 decode(BitReader& br) const {
+        if (br.cnt < max_bits) br.refill();
+        const Entry& e = dtable[br.peek(max_bits)];
+        if (!e.len) throw runtime_error("corrupt huffman code");
+        br.skip(e.len);
+        return e.sym;
+    }
+
+    // Bits needed to code a histogram with this table (0 if a symbol has no code).
+    u64 cost(const vector<u32>& freq) const {
+        u64 bits = 0;
+        for (size_t s = 0; s < freq.size(); ++s) {
+            if (!freq[s]) continue;
+            if (s >= lens.size() || !lens[s]) return 0;
+            bits += u64(freq[s]) * lens[s];
+        }
+        return bits;
+    }
+
+    // Decodes count bytes into dst, two symbols per lookup where both codes
+    // fit in max_bits.
+    void decode_bytes(BitReader& br, u8* dst, size_t count) const {
+        struct Pair { u8 sym[2]; u8 nsyms; u8 bits; };
+        vector<Pair> pairs(size_t(1) << max_bits);
+        for (u32 idx = 0; idx < pairs.size(); ++idx) {
+            const Entry& a = dtable[idx];
+            Pair& pr = pairs[idx];
+            pr.sym[0] = (u8)a.sym; pr.sym[1] = 0; pr.nsyms = 1; pr.bits = a.len;
+            if (!a.len) continue;
+            const Entry& b = dtable[idx >> a.len];
+            if (b.len && a.len + b.len <= max_bits) {
+                pr.sym[1] = (u8)b.sym; pr.nsyms = 2; pr.bits = u8(a.len + b.len);
+            }
+        }
+        size_t i = 0;
+        while (i + 2 <= count) {
+            if (br.cnt < max_bits) br.refill();
+            const Pair& pr = pairs[br.peek(max_bits)];
+            if (!pr.bits) throw runtime_error("corrupt huffman code");
+            br.skip(pr.bits);
+            dst[i] = pr.sym[0];
+            dst[i + 1] = pr.sym[1];
+            i += pr.nsyms;
+        }
+        for (; i < count; ++i) {
+            if (br.cnt < max_bits) br.refill();
+            const Entry& e = dtable[br.peek(max_bits)];
+            if (!e.len) throw runtime_error("corrupt huffman code");
+            br.skip(e.len);
+            dst[i] = (u8)e.sym;
+        }
+    }
+
+private:
+    void assign_codes() {
+        codes.assign(lens.size(), 0);
+        u32 code = 0;
+        for (unsigned len = 1; len <= max_bits; ++len) {
+            for (size_t s = 0; s < lens.size(); ++s) {
+                if (lens[s] != len) continue;
+                u32 rev = 0;
+                for (unsigned b = 0; b < len; ++b) rev |= ((code >> b) & 1) << (len - 1 - b);
+                codes[s] = (u16)rev;
+                ++code;
+            }
+            code <<= 1;
+        }
+    }
+
+    void build_decoder() {
+        dtable.assign(size_t(1) << max_bits, Entry{0, 0});
+        for (size_t s = 0; s < lens.size(); ++s) {
+            if (!lens[s]) continue;
+            for (u32 k = codes[s]; k < dtable.size(); k += 1u << lens[s]) dtable[k] = {(u16)s, lens[s]};
+        }
+    }
+};
+
+// ---------------------- FSE ----------------------
+// Table-based asymmetric numeral system coder (tANS, as in FSE). Symbol
+// frequencies are normalised to 1 << table_log slots, which lets a symbol cost
+// a fractional number of bits. The encoder consumes symbols last to first, so
+// its output has to be replayed in reverse before the decoder reads it forwards.
+struct FseTable {
+    static constexpr unsigned min_log = 5, max_log = 11;
+    struct Entry { u16 base; u8 sym; u8 bits; };
+
+    unsigned table_log = min_log;
+    vector<u16> norm;   // slots per symbol, summing to 1 << table_log
+    vector<u16> slots;  // encoder: table positions of each symbol, grouped per symbol
+    vector<u32> first;  // encoder: start of a symbol's group in slots
+    vector<Entry> dtable;
+
+    void build(const vector<u32>& freq) {
+        size_t n = freq.size();
+        while (n && !freq[n - 1]) --n;
+        u64 total = 0;
+        unsigned used = 0;
+        size_t big = 0;
+        for (size_t s = 0; s < n; ++s) {
+            total += freq[s];
+            if (freq[s]) ++used;
+            if (freq[s] > freq[big]) big = s;
+        }
+        norm.assign(n, 0);
+        table_log = min_log;
+        if (total) {
+            table_log = min<unsigned>(max_log, log2_u32((u32)min<u64>(total, 0xFFFFFFFFu)) + 1);
+            table_log = max({table_log, min_log, log2_u32(used) + 2});
+        }
+        u32 size = 1u << table_log;
+        if (total) {
+            u64 sum = 0;
+            for (size_t s = 0; s < n; ++s) {
+                if (!freq[s]) continue;
+                norm[s] = (u16)max<u64>(1, (u64(freq[s]) * size + total / 2) / total);
+                sum += norm[s];
+            }
+            if (sum < size) norm[big] = u16(norm[big] + (size - sum));
+            while (sum > size) { // rounding overshot: trim the largest entries
+                size_t top = big;
+                for (size_t s = 0; s < n; ++s) if (norm[s] > norm[top]) top = s;
+                --norm[top];
+                --sum;
+            }
+        }
+        prepare();
+    }
+
+    // Table: u8 table_log, varint symbol count, then a varint slot count per symbol.
+    void write(vector<u8>& out) const {
+        out.push_back((u8)table_log);
+        put_varint(out, norm.size());
+        for (u16 v : norm) put_varint(out, v);
+    }
+
+    void read(const vector<u8>& in, size_t& pos, size_t alphabet) {
+        if (pos >= in.size()) throw runtime_error("corrupt fse table");
+        table_log = in[pos++];
+        if (table_log < min_log || table_log > max_log) throw runtime_error("corrupt fse table");
+        u64 n = get_varint(in, pos);
+        if (n > alphabet) throw runtime_error("corrupt fse table");
+        norm.assign((size_t)n, 0);
+        u64 sum = 0;
+        for (size_t s = 0; s < n; ++s) {
+            u64 v = get_varint(in, pos);
+            sum += v;
+            if (sum > (1u << table_log)) throw runtime_error("corrupt fse table");
+            norm[s] = (u16)v;
+        }
+        if (sum != (1u << table_log)) throw runtime_error("corrupt fse table");
+        prepare();
+    }
+
+    // Encoder states live in [size, 2 * size); decoder states are state - size.
+    u32 initial_state() const { return 1u << table_log; }
+
+    // Moves state past sym; the low `nbits` bits of `bits` must be emitted.
+    void encode(u32& state, u32 sym, u32& bits, unsigned& nbits) const {
+        u32 n = norm[sym];
+        nbits = table_log - log2_u32(n);
+        if ((state >> nbits) < n) --nbits;
+        bits = state & ((1u << nbits) - 1);
+        state = slots[first[sym] + (state >> nbits) - n] + (1u << table_log);
+    }
+
+    u32 decode(u32& state, BitReader& br) const {
+        const Entry& e = dtable[state];
+        state = e.base + br.get(e.bits);
+        return e.sym;
+    }
+
+    // Estimated bits to code a histogram with this table, header included.
+    double cost(const vector<u32>& freq) const {
+        double bits = 0;
+        for (size_t s = 0; s < freq.size(); ++s)
+            if (freq[s]) bits += freq[s] * (table_log - log2((double)norm[s]));
+        vector<u8> hdr;
+        write(hdr);
+        return bits + hdr.size() * 8.0;
+    }
+
+private:
+    void prepare() {
+        if (norm.empty()) { first.clear(); slots.clear(); dtable.clear(); return; }
+        u32 size = 1u << table_log, mask = size - 1;
+        u32 step = (size >> 1) + (size >> 3) + 3;
+        vector<u8> spread(size);
+        u32 at = 0;
+        for (size_t s = 0; s < norm.size(); ++s)
+            for (u32 k = 0; k < norm[s]; ++k) { spread[at] = (u8)s; at = (at + step) & mask; }
+
+        first.assign(norm.size(), 0);
+        for (size_t s = 1; s < norm.size(); ++s) first[s] = first[s - 1] + norm[s - 1];
+        slots.assign(size, 0);
+        dtable.assign(size, Entry{0, 0, 0});
+        vector<u32> next(norm.begin(), norm.end());
+        for (u32 p = 0; p < size; ++p) {
+            u8 s = spread[p];
+            u32 v = next[s]++;
+            slots[first[s] + v - norm[s]] = (u16)p;
+            unsigned nb = table_log - log2_u32(v);
+            dtable[p] = {u16((v << nb) - size), s, (u8)nb};
+        }
+    }
+};
+
+// Lengths and offsets are coded as a bucket symbol plus raw extra bits:
+// values below 16 are their own symbol, larger ones use their bit length and
+// the bit below the leading one, leaving bit_length - 2 extra bits.
+static constexpr u32 value_code_count = 72;
+static constexpr u32 value_code_direct = 16; // values below this need no extra bits
+
+static inline u32 value_code(u32 v, u32& extra, unsigned& extra_bits) {
+    if (v < value_code_direct) { extra = 0; extra_bits = 0; return v; }
+    unsigned b = log2_u32(v);
+    extra_bits = b - 1;
+    extra = v & ((1u << extra_bits) - 1);
+    return 16 + (b - 4) * 2 + ((v >> (b - 1)) & 1);
+}
+
+static inline u32 value_from_code(u32 code, BitReader& br) {
+    if (code < 16) return code;
+    unsigned b = (code - 16) / 2 + 4;
+    u32 hi = (code - 16) & 1;
+    return (1u << b) | (hi << (b - 1)) | br.get(b - 1);
+}
+
 // ---------------------- Simple LZ77 ----------------------
-// Token format used here (byte-aligned simple format):
+// The parsers produce sequences (a run of literals followed by a match) which
+// are then serialised in one of the token formats below (byte-aligned):
+//
+// TokenFormat::Flag
 // - Literal token: 1 byte flag 0x00, then 1 byte literal value
-// - Match token:   1 byte flag 0x01, then 2 bytes offset (big-endian), then 1 byte length (1..255)
+// - Match token:   1 byte flag 0x01, then the offset, then 1 byte length 3..255,
+//                  or 0 followed by a varint length
+// The offset is a varint offset code (see RepOffsets), or a plain distance in 2
+// bytes big-endian in TokenFormat::Mtc1 (read-only support for MTC1 files
+// from earlier versions). All other formats code offsets the same way.
+//
+// TokenFormat::Bitmap
+// - Tokens come in groups of up to 16, each led by a little-endian u16 control
+//   word whose bit i is set when token i of the group is a match
+// - Literal token: the literal byte; a run of literals is copied in one go
+// - Match token:   varint offset, then 1 byte length 3..255, or 0 followed by a
+//                  varint length
+//
+// TokenFormat::Sequence (LZ4-style, built for decode speed)
+// - Token byte: high nibble literal count, low nibble match length - 3; a
+//   nibble of 15 continues in extra bytes of 255 ending with one below 255
+// - Literal count extension, the literals, varint offset, match length extension
+// - The last sequence may stop after its literals
+//
+// Every chunk's stream starts with a BlockType byte (MTC1 streams excepted):
+// - Tokens:  the token format above
+// - Huffman: varint literal count, varint sequence count, Huffman tables for
+//   literals, literal-run lengths, match lengths - 3 and offsets; varint size
+//   of the literal bitstream and the bitstream; then one bitstream with each
+//   sequence's three length/offset codes and their extra bits
+// - Fse: as Huffman, but the length/offset codes use FSE tables; the sequence
+//   bitstream opens with the three initial states, then per sequence the three
+//   extra-bit fields followed by the three state updates
+// - Stored:  the input bytes as they are, used when nothing else is smaller
+// - Rle:     varint byte count, then the byte that fills the whole input
+
+enum class TokenFormat : u8 { Mtc1, Flag, Bitmap, Sequence };
+enum class BlockType : u8 { Tokens, Huffman, Fse, Stored, Rle };
+
+// The three most recent match offsets. A match reusing one of them is coded
+// as 1..3 (rep0..rep2, which then moves to the front); any other distance d is
+// coded as d + 3 and pushed in front. Every chunk starts from the same history.
+// Distances whose own code needs no extra bits are always sent as d + 3: a
+// stable code per short distance entropy-codes better than a recency index.
+struct RepOffsets {
+    static constexpr u32 count = 3;
+    u32 rep[count] = {1, 4, 8};
+
+    u32 code_of(u32 off) const {
+        if (off + count >= value_code_direct)
+            for (u32 k = 0; k < count; ++k) if (rep[k] == off) return k + 1;
+        return off + count;
+    }
+    u32 encode(u32 off) {
+        u32 code = code_of(off);
+        update(code, off);
+        return code;
+    }
+    u32 decode(u64 code) {
+        if (code == 0 || (code > count && code - count > UINT32_MAX)) throw runtime_error("invalid offset");
+        u32 off = code <= count ? rep[code - 1] : u32(code - count);
+        update((u32)min<u64>(code, count + 1), off);
+        return off;
+    }
+
+private:
+    void update(u32 code, u32 off) {
+        u32 from = code <= count ? code - 1 : count - 1;
+        for (u32 k = from; k > 0; --k) rep[k] = rep[k - 1];
+        rep[0] = off;
+    }
+};
+
+struct Sequence {
+    u32 lit_len;   // literals copied from the input before the match
+    u32 match_len; // 0 only in a trailing literals-only sequence
+    u32 offset;    // coded offset, see RepOffsets
+};
+
+// Collects parser output: literal() for each literal byte, match() per match.
+// Offsets are turned into repeat codes as they arrive; parsers read reps to
+// probe and price the recent offsets.
+struct SequenceWriter {
+    vector<Sequence>& seqs;
+    u32 lits = 0;
+    RepOffsets reps;
+
+    explicit SequenceWriter(vector<Sequence>& out) : seqs(out) {}
+    void literal() { ++lits; }
+    void match(size_t off, size_t len) { seqs.push_back({lits, (u32)len, reps.encode((u32)off)}); lits = 0; }
+    void finish() { if (lits) seqs.push_back({lits, 0, 0}); lits = 0; }
+};
 
 struct LZ77 {
-    size_t window_size = 1 << 12; // 4096
-    size_t lookahead = 255;       // max match length
+    LZ77Params params;
+    TokenFormat format = TokenFormat::Bitmap;
+    bool entropy = true;          // also try a Huffman block, keep the smaller
+
+    static constexpr size_t min_match = 3;
+    static constexpr size_t run_min = 64;        // shortest run taken by the RLE path
+    static constexpr size_t max_run_period = 8;  // longest repeating pattern it detects
+    static constexpr size_t insert_tail = 256;   // positions of a long match given to the finder
+
+    // Token prices for the optimal parser in 1/scale bits, taken from the symbol
+    // statistics of an earlier parse (see entropy_prices). Literal run
+    // lengths are not known while a match is priced, so each match is charged
+    // the average run length cost.
+    struct TokenPrices {
+        static constexpr u32 scale = 16;
+        u32 lit[256];
+        u32 ll = 0;
+        u32 ml[value_code_count], of[value_code_count];
+
+        // code is the coded offset (see RepOffsets).
+        u32 match(u32 code, size_t len) const {
+            u32 extra;
+            unsigned ml_bits, of_bits;
+            u32 m = value_code(u32(len - min_match), extra, ml_bits), o = value_code(code, extra, of_bits);
+            return ll + ml[m] + of[o] + (ml_bits + of_bits) * scale;
+        }
+    };
+
+    // history (e.g. the tail of the previous chunk) is preloaded into the
+    // window, so matches may reach back into it; decompress needs the same bytes.
+    vector<u8> compress(const vector<u8>& input, const u8* history = nullptr, size_t history_len = 0){
+        size_t keep = min(history_len, params.window_size);
+        if (keep == 0) return compress_range(input.data(), 0, input.size());
+        vector<u8> buf;
+        buf.reserve(keep + input.size());
+        buf.insert(buf.end(), history + (history_len - keep), history + history_len);
+        buf.insert(buf.end(), input.begin(), input.end());
+        return compress_range(buf.data(), keep, buf.size());
+    }
+
+    // Encodes data[start, n); data[0, start) is window history only.
+    vector<u8> compress_range(const u8* data, size_t start, size_t n){
+        size_t len = n - start;
+        if (len > 1 && memcmp(data + start, data + start + 1, len - 1) == 0) {
+            vector<u8> out{(u8)BlockType::Rle};
+            put_varint(out, len);
+            out.push_back(data[start]);
+            return out;
+        }
+        vector<Sequence> seqs;
+        parse(data, start, n, seqs, nullptr);
+        vector<u8> out = encode_block(data + start, len, seqs);
+        // Further optimal passes price tokens as the entropy coder saw the
+        // previous parse; a pass is kept only if its block is smaller.
+        if (params.parser == Parser::Optimal && entropy)
+            for (size_t k = 1; k < params.opt_passes && out[0] != (u8)BlockType::Stored; ++k) {
+                TokenPrices prices = entropy_prices(data + start, seqs);
+                vector<Sequence> again;
+                parse(data, start, n, again, &prices);
+                vector<u8> block = encode_block(data + start, len, again);
+                if (block.size() >= out.size()) break;
+                out = move(block);
+                seqs = move(again);
+            }
+        return out;
+    }
+
+    // Tokens, Huffman/FSE or Stored block for seqs over src[0, len), whichever is smallest.
+    vector<u8> encode_block(const u8* src, size_t len, const vector<Sequence>& seqs) const {
+        vector<u8> out{(u8)BlockType::Tokens};
+        vector<u8> body = encode(src, seqs);
+        if (entropy) {
+            BlockType type;
+            vector<u8> coded = encode_entropy(src, seqs, type);
+            if (coded.size() < body.size()) { out[0] = (u8)type; body = move(coded); }
+        }
+        if (body.size() >= len) {
+            out[0] = (u8)BlockType::Stored;
+            out.insert(out.end(), src, src + len);
+            return out;
+        }
+        out.insert(out.end(), body.begin(), body.end());
+        return out;
+    }
+
+    // prices (optimal parser only) replaces the format's token prices.
+    void parse(const u8* data, size_t start, size_t n, vector<Sequence>& seqs, const TokenPrices* prices){
+        if (params.finder == MatchFinder::BinaryTree) parse_with<BinaryTreeFinder>(data, start, n, seqs, prices);
+        else parse_with<HashChainFinder>(data, start, n, seqs, prices);
+    }
+
+    template<class Finder>
+    void parse_with(const u8* data, size_t start, size_t n, vector<Sequence>& seqs, const TokenPrices* prices){
+        Finder mf;
+        mf.reset(data, n, params);
+        for (size_t p = 0; p < start; ++p) mf.insert(p);
+        SequenceWriter sw{seqs};
+        switch (params.parser) {
+        case Parser::Lazy: parse_lazy(mf, data, start, n, 1, sw); break;
+        case Parser::Lazy2: parse_lazy(mf, data, start, n, 2, sw); break;
+        case Parser::Optimal: parse_optimal(mf, data, start, n, sw, prices); break;
+        default: parse_greedy(mf, data, start, n, sw); break;
+        }
+        sw.finish();
+    }
+
+    // Token cost in bits for the current format; the optimal parser minimises the sum.
+    u32 literal_price() const {
+        switch (format) {
+        case TokenFormat::Bitmap: return 9;
+        case TokenFormat::Sequence: return 8;
+        default: return 16;
+        }
+    }
+    // code is the coded offset (see RepOffsets).
+    u32 match_price(size_t code, size_t len) const {
+        u32 long_len = len > 255 ? 8 * varint_size(len) : 0;
+        switch (format) {
+        case TokenFormat::Bitmap: return 9 + 8 * varint_size(code) + long_len;
+        case TokenFormat::Sequence: return 8 + 8 * varint_size(code) + (len - min_match >= 15 ? 8 + 8 * u32((len - min_match - 15) / 255) : 0);
+        default: return 16 + 8 * varint_size(code) + long_len;
+        }
+    }
+
+    // Prices from the symbol counts of seqs over src, as encode_entropy would
+    // see them; a symbol costs log2(total / count), an unseen one as if seen once.
+    static TokenPrices entropy_prices(const u8* src, const vector<Sequence>& seqs) {
+        vector<u32> lit_freq(256), ll_freq(value_code_count), ml_freq(value_code_count), of_freq(value_code_count);
+        u64 ll_extra = 0, nseqs = 0;
+        u32 extra;
+        unsigned extra_bits;
+        for (const Sequence& s : seqs) {
+            for (u32 k = 0; k < s.lit_len; ++k) ++lit_freq[src[k]];
+            src += s.lit_len + s.match_len;
+            if (!s.match_len) continue;
+            ++nseqs;
+            ++ll_freq[value_code(s.lit_len, extra, extra_bits)];
+            ll_extra += extra_bits;
+            ++ml_freq[value_code(s.match_len - (u32)min_match, extra, extra_bits)];
+            ++of_freq[value_code(s.offset, extra, extra_bits)];
+        }
+        auto fill = [](const vector<u32>& freq, u32* price) {
+            double total = accumulate(freq.begin(), freq.end(), 0.0) + freq.size();
+            for (size_t s = 0; s < freq.size(); ++s) price[s] = u32(TokenPrices::scale * log2(total / (freq[s] + 1)));
+        };
+        TokenPrices pr;
+        u32 ll[value_code_count];
+        fill(lit_freq, pr.lit); fill(ll_freq, ll); fill(ml_freq, pr.ml); fill(of_freq, pr.of);
+        if (nseqs) {
+            u64 sum = ll_extra * TokenPrices::scale;
+            for (u32 c = 0; c < value_code_count; ++c) sum += u64(ll_freq[c]) * ll[c];
+            pr.ll = u32(sum / nseqs);
+        }
+        return pr;
+    }
+
+    // A run at pos: the bytes repeat with a period of up to max_run_period
+    // for at least run_min bytes. The match may be of any length and reaches
+    // the end of the run; len 0 if there is none.
+    Match run_at(const u8* data, size_t pos, size_t n) const {
+        if (n - pos < run_min || pos < max_run_period) return {0, 0};
+        u64 v = load64(data + pos);
+        for (size_t p = 1; p <= max_run_period; ++p) {
+            if (load64(data + pos - p) != v) continue;
+            size_t len = match_length(data + pos, data + pos - p, n - pos);
+            if (len >= run_min) return {(u32)len, (u32)p};
+        }
+        return {0, 0};
+    }
 
-    vector<u8> compress(const vector<u8>& input){
+    // Inserts positions [from, to) of a match into the finder. A match
+    // longer than insert_tail only gets its tail inserted: the bytes inside
+    // it are already reachable through the copy it was matched against.
+    template<class Finder>
+    void insert_covered(Finder& mf, size_t from, size_t to) {
+        if (to - from > insert_tail) from = to - insert_tail;
+        for (; from < to; ++from) mf.insert(from);
+    }
+
+    // Longest match at pos against the recent offsets; len 0 if none reaches min_match.
+    Match rep_match(const u8* data, size_t pos, size_t n, const RepOffsets& reps) const {
+        Match best{0, 0};
+        size_t limit = min(params.lookahead, n - pos);
+        if (limit < min_match) return best;
+        for (u32 r : reps.rep) {
+            if (r > pos || r > params.window_size || reps.code_of(r) > RepOffsets::count) continue;
+            size_t len = match_length(data + pos, data + pos - r, limit);
+            if (len >= min_match && len > best.len) best = {(u32)len, r};
+        }
+        return best;
+    }
+
+    // Candidate at pos for the greedy and lazy parsers (len 0: none); pos is
+    // inserted into the finder on every path, the callers insert from pos + 1.
+    // Runs are taken as found. The recent offsets are probed next and a
+    // repeat of nice_len is taken without searching the finder. Otherwise a
+    // repeat wins unless the finder's match is at least two bytes longer,
+    // since a repeat code is cheaper than a far distance; a short distance is
+    // as cheap, so it only has to be as long.
+    template<class Finder>
+    Match best_match(Finder& mf, const u8* data, size_t pos, size_t n, const RepOffsets& reps, vector<Match>& matches){
+        Match run = run_at(data, pos, n);
+        if (run.len) { mf.insert(pos); return run; }
+        Match rep = rep_match(data, pos, n, reps);
+        if (rep.len >= params.nice_len) { mf.insert(pos); return rep; }
+        mf.find_all(pos, matches);
+        if (!matches.empty()) {
+            const Match& m = matches.back();
+            bool near = reps.code_of(m.off) < value_code_direct;
+            if (m.len > rep.len + 1 || (near && m.len >= rep.len)) return m;
+        }
+        return rep;
+    }
+
+    // Worth of a match to the lazy parser, in quarter bytes: its length less
+    // the bits of its offset code. Entropy coding makes a literal cost less
+    // and a new offset more than their token bytes, so a match that only
+    // wins on length at a far offset, breaking a run of repeat offsets as
+    // on record data, is not worth deferring to.
+    int lazy_gain(const Match& m, const RepOffsets& reps) const {
+        return 4 * int(m.len) - 2 * int(log2_u32(reps.code_of(m.off) + 1));
+    }
+
+    // Greedy parse: always take the best match at pos.
+    template<class Finder>
+    void parse_greedy(Finder& mf, const u8* data, size_t start, size_t n, SequenceWriter& sw){
+        size_t pos = start;
+        vector<Match> matches;
+        while (pos < n) {
+            Match m = best_match(mf, data, pos, n, sw.reps, matches);
+            if (m.len) {
+                sw.match(m.off, m.len);
+                insert_covered(mf, pos + 1, pos + m.len);
+                pos += m.len;
+            } else {
+                sw.literal();
+                ++pos;
+            }
+        }
+    }
+
+    // Lazy parse: before committing to a match, probe up to `depth` following
+    // positions; a match found d bytes later wins if its lazy_gain beats the
+    // current one by more than the d literals it adds, in which case the
+    // skipped bytes become literals and the lookahead restarts from the new
+    // match.
+    template<class Finder>
+    void parse_lazy(Finder& mf, const u8* data, size_t start, size_t n, size_t depth, SequenceWriter& sw){
+        size_t pos = start;
+        vector<Match> matches;
+        while (pos < n) {
+            Match best = best_match(mf, data, pos, n, sw.reps, matches);
+            if (!best.len) {
+                sw.literal();
+                ++pos;
+                continue;
+            }
+            size_t best_pos = pos;
+            size_t probed = pos; // last position inserted into the finder
+            for (size_t d = 1; d <= depth && best.len < params.nice_len && best_pos + d < n; ++d) {
+                probed = best_pos + d;
+                Match m = best_match(mf, data, probed, n, sw.reps, matches);
+                if (m.len && lazy_gain(m, sw.reps) > lazy_gain(best, sw.reps) + int(3 * d + 1)) {
+                    best = m;
+                    best_pos = probed;
+                    d = 0;
+                }
+            }
+            for (; pos < best_pos; ++pos) sw.literal();
+            sw.match(best.off, best.len);
+            insert_covered(mf, probed + 1, best_pos + best.len);
+            pos = best_pos + best.len;
+        }
+    }
+
+    // Optimal parse: forward dynamic programming over blocks of opt_block
+    // positions. nodes[i] holds the cheapest price of reaching block start + i
+    // and the token that got there; once the block is done the cheapest path
+    // is walked back from its end. Matches are clipped at the block end; runs
+    // and matches of nice_len are taken outright instead, which ends the block
+    // early and emits the match after the block's path, whatever its length.
+    // Each node also carries the recent offsets of its path, so repeat matches
+    // are probed and priced as the chosen path would code them. Without
+    // prices, tokens cost what the format spends on them.
+    template<class Finder>
+    void parse_optimal(Finder& mf, const u8* data, size_t start, size_t n, SequenceWriter& sw, const TokenPrices* prices){
+        const size_t opt_block = params.opt_block;
+        auto lit_price = [&](size_t pos) { return prices ? prices->lit[data[pos]] : literal_price() * TokenPrices::scale; };
+        auto price = [&](u32 code, size_t len) { return prices ? prices->match(code, len) : match_price(code, len) * TokenPrices::scale; };
+        struct Node { u32 price; u32 len; u32 off; RepOffsets reps; }; // off == 0: literal
+        vector<Match> matches;
+        vector<Node> nodes(opt_block + 1);
+        vector<Node> path;
+        for (size_t block = start; block < n; ) {
+            size_t span = min(opt_block, n - block);
+            nodes[0] = {0, 0, 0, sw.reps};
+            for (size_t i = 1; i < nodes.size(); ++i) nodes[i].price = UINT32_MAX;
+            auto relax = [&](size_t to, u32 price, size_t len, size_t off) {
+                if (price < nodes[to].price) { nodes[to].price = price; nodes[to].len = (u32)len; nodes[to].off = (u32)off; }
+            };
+            size_t i = 0;
+            Match take{0, 0}; // match taken outright at block + i
+            while (i < span) {
+                size_t pos = block + i;
+                Node& node = nodes[i];
+                if (i) { // every way into i is known by now
+                    node.reps = nodes[i - node.len].reps;
+                    if (node.off) node.reps.encode(node.off);
+                }
+                take = run_at(data, pos, n);
+                if (take.len) { insert_covered(mf, pos, pos + take.len); break; }
+                Match rep = rep_match(data, pos, n, node.reps);
+                if (rep.len >= params.nice_len) { take = rep; insert_covered(mf, pos, pos + take.len); break; }
+                mf.find_all(pos, matches);
+                if (!matches.empty() && matches.back().len >= params.nice_len) {
+                    // long enough that exploring alternatives is not worth it
+                    take = matches.back();
+                    insert_covered(mf, pos + 1, pos + take.len);
+                    break;
+                }
+                u32 base = node.price;
+                relax(i + 1, base + lit_price(pos), 1, 0);
+                if (rep.len) {
+                    u32 code = node.reps.code_of(rep.off);
+                    size_t top = min<size_t>(rep.len, span - i);
+                    for (size_t len = min_match; len <= top; ++len) relax(i + len, base + price(code, len), len, rep.off);
+                }
+                size_t len = min_match;
+                for (const Match& m : matches) {
+                    u32 code = node.reps.code_of(m.off);
+                    size_t top = min<size_t>(m.len, span - i);
+                    for (; len <= top; ++len) relax(i + len, base + price(code, len), len, m.off);
+                }
+                ++i;
+            }
+            path.clear();
+            for (size_t at = i; at > 0; at -= nodes[at].len) path.push_back(nodes[at]);
+            for (auto it = path.rbegin(); it != path.rend(); ++it) {
+                if (it->off == 0) sw.literal();
+                else sw.match(it->off, it->len);
+                block += it->len;
+            }
+            if (take.len) {
+                sw.match(take.off, take.len);
+                block += take.len;
+            }
+        }
+    }
+
+    // Flag/Bitmap match length: one byte, or 0 and a varint above 255.
+    static void put_match_len(vector<u8>& out, size_t len) {
+        if (len <= 255) { out.push_back((u8)len); return; }
+        out.push_back(0);
+        put_varint(out, len);
+    }
+
+    // Serialises seqs in the current format; src holds the literals in order.
+    vector<u8> encode(const u8* src, const vector<Sequence>& seqs) const {
         vector<u8> out;
+        if (format == TokenFormat::Sequence) {
+            auto put_extra = [&](size_t v) {
+                for (; v >= 255; v -= 255) out.push_back(255);
+                out.push_back((u8)v);
+            };
+            for (const Sequence& s : seqs) {
+                size_t ml = s.match_len ? s.match_len - min_match : 0;
+                out.push_back(u8((min<size_t>(s.lit_len, 15) << 4) | min<size_t>(ml, 15)));
+                if (s.lit_len >= 15) put_extra(s.lit_len - 15);
+                out.insert(out.end(), src, src + s.lit_len);
+                src += s.lit_len;
+                if (!s.match_len) continue;
+                put_varint(out, s.offset);
+                if (ml >= 15) put_extra(ml - 15);
+                src += s.match_len;
+            }
+        } else if (format == TokenFormat::Bitmap) {
+            size_t ctrl_at = 0;
+            int slot = 16;
+            auto token = [&](bool is_match) {
+                if (slot == 16) { ctrl_at = out.size(); out.push_back(0); out.push_back(0); slot = 0; }
+                if (is_match) out[ctrl_at + (slot >> 3)] |= u8(1u << (slot & 7));
+                ++slot;
+            };
+            for (const Sequence& s : seqs) {
+                for (u32 k = 0; k < s.lit_len; ++k) { token(false); out.push_back(*src++); }
+                if (!s.match_len) continue;
+                token(true);
+                put_varint(out, s.offset);
+                put_match_len(out, s.match_len);
+                src += s.match_len;
+            }
+        } else {
+            for (const Sequence& s : seqs) {
+                for (u32 k = 0; k < s.lit_len; ++k) { out.push_back(0x00); out.push_back(*src++); }
+                if (!s.match_len) continue;
+                out.push_back(0x01);
+                put_varint(out, s.offset);
+                put_match_len(out, s.match_len);
+                src += s.match_len;
+            }
+        }
+        return out;
+    }
+
+    // Huffman or FSE block for seqs, see the layout above. The length and
+    // offset codes use whichever coder is estimated to be smaller; type is set
+    // to match.
+    vector<u8> encode_entropy(const u8* src, const vector<Sequence>& seqs, BlockType& type) const {
+        vector<u32> lit_freq(256), ll_freq(value_code_count), ml_freq(value_code_count), of_freq(value_code_count);
+        size_t nlits = 0, nseqs = 0;
+        u32 extra;
+        unsigned extra_bits;
+        const u8* p = src;
+        for (const Sequence& s : seqs) {
+            for (u32 k = 0; k < s.lit_len; ++k) ++lit_freq[p[k]];
+            nlits += s.lit_len;
+            p += s.lit_len + s.match_len;
+            if (!s.match_len) continue;
+            ++nseqs;
+            ++ll_freq[value_code(s.lit_len, extra, extra_bits)];
+            ++ml_freq[value_code(s.match_len - (u32)min_match, extra, extra_bits)];
+            ++of_freq[value_code(s.offset, extra, extra_bits)];
+        }
+        HuffmanTable lit, ll, ml, of;
+        lit.build(lit_freq); ll.build(ll_freq); ml.build(ml_freq); of.build(of_freq);
+        FseTable fll, fml, fof;
+        type = BlockType::Huffman;
+        if (nseqs) {
+            fll.build(ll_freq); fml.build(ml_freq); fof.build(of_freq);
+            auto huff_cost = [](const HuffmanTable& t, const vector<u32>& f) {
+                vector<u8> hdr;
+                t.write(hdr);
+                return double(t.cost(f)) + hdr.size() * 8.0;
+            };
+            double huff = huff_cost(ll, ll_freq) + huff_cost(ml, ml_freq) + huff_cost(of, of_freq);
+            double fse = fll.cost(ll_freq) + fml.cost(ml_freq) + fof.cost(of_freq) + 3 * FseTable::max_log;
+            if (fse < huff) type = BlockType::Fse;
+        }
+
+        vector<u8> out;
+        put_varint(out, nlits);
+        put_varint(out, nseqs);
+        lit.write(out);
+        if (type == BlockType::Fse) { fll.write(out); fml.write(out); fof.write(out); }
+        else { ll.write(out); ml.write(out); of.write(out); }
+
+        vector<u8> lit_bits;
+        BitWriter lw{lit_bits};
+        p = src;
+        for (const Sequence& s : seqs) {
+            for (u32 k = 0; k < s.lit_len; ++k) lit.encode(lw, p[k]);
+            p += s.lit_len + s.match_len;
+        }
+        lw.flush();
+        put_varint(out, lit_bits.size());
+        out.insert(out.end(), lit_bits.begin(), lit_bits.end());
+
+        BitWriter sw{out};
+        auto put_extra = [&](u32 v) {
+            value_code(v, extra, extra_bits);
+            if (extra_bits) sw.put(extra, extra_bits);
+        };
+        if (type == BlockType::Huffman) {
+            auto put_value = [&](const HuffmanTable& t, u32 v) {
+                t.encode(sw, value_code(v, extra, extra_bits));
+                if (extra_bits) sw.put(extra, extra_bits);
+            };
+            for (const Sequence& s : seqs) {
+                if (!s.match_len) continue;
+                put_value(ll, s.lit_len);
+                put_value(ml, s.match_len - (u32)min_match);
+                put_value(of, s.offset);
+            }
+        } else {
+            // Run the three coders backwards, keeping each step's state bits,
+            // then emit everything in decoding order.
+            struct Step { u32 bits[3]; u8 nbits[3]; };
+            vector<Step> steps(nseqs);
+            const FseTable* tabs[3] = {&fll, &fml, &fof};
+            u32 state[3] = {fll.initial_state(), fml.initial_state(), fof.initial_state()};
+            size_t k = nseqs;
+            for (auto it = seqs.rbegin(); it != seqs.rend(); ++it) {
+                if (!it->match_len) continue;
+                u32 vals[3] = {it->lit_len, it->match_len - (u32)min_match, it->offset};
+                Step& st = steps[--k];
+                for (int t = 0; t < 3; ++t) {
+                    unsigned nb;
+                    tabs[t]->encode(state[t], value_code(vals[t], extra, extra_bits), st.bits[t], nb);
+                    st.nbits[t] = (u8)nb;
+                }
+            }
+            for (int t = 0; t < 3; ++t) sw.put(state[t] - tabs[t]->initial_state(), tabs[t]->table_log);
+            for (const Sequence& s : seqs) {
+                if (!s.match_len) continue;
+                put_extra(s.lit_len);
+                put_extra(s.match_len - (u32)min_match);
+                put_extra(s.offset);
+                const Step& st = steps[k++];
+                for (int t = 0; t < 3; ++t) if (st.nbits[t]) sw.put(st.bits[t], st.nbits[t]);
+            }
+        }
+        sw.flush();
+        return out;
+    }
+
+    // Decodes into dst, which has room for capacity bytes (the chunk size is
+    // known from the container); returns the number of bytes written.
+    size_t decompress_into(const vector<u8>& input, u8* dst, size_t capacity,
+                           const u8* history = nullptr, size_t history_len = 0) const {
+        size_t keep = min(history_len, params.window_size);
+        Output out{dst, dst, dst + capacity, history + (history_len - keep), keep};
+        if (format == TokenFormat::Mtc1) {
+            decode_flag(input, 0, out);
+        } else {
+            if (input.empty()) throw runtime_error("missing block type");
+            switch ((BlockType)input[0]) {
+            case BlockType::Tokens:
+                if (format == TokenFormat::Sequence) decode_sequence(input, 1, out);
+                else if (format == TokenFormat::Bitmap) decode_bitmap(input, 1, out);
+                else decode_flag(input, 1, out);
+                break;
+            case BlockType::Huffman: decode_entropy(input, 1, false, out); break;
+            case BlockType::Fse: decode_entropy(input, 1, true, out); break;
+            case BlockType::Stored: put_literals(out, input.data() + 1, input.size() - 1); break;
+            case BlockType::Rle: {
+                size_t pos = 1;
+                u64 count = get_varint(input, pos);
+                if (pos + 1 != input.size() || count > out.room()) throw runtime_error("corrupt rle block");
+                memset(out.op, input[pos], (size_t)count);
+                out.op += count;
+                break;
+            }
+            default: throw runtime_error("unknown block type");
+            }
+        }
+        return size_t(out.op - out.begin);
+    }
+
+    // size is the decoded size, or an upper bound of it.
+    vector<u8> decompress(const vector<u8>& input, size_t size, const u8* history = nullptr, size_t history_len = 0) const {
+        vector<u8> out(size);
+        out.resize(decompress_into(input, out.data(), out.size(), history, history_len));
+        return out;
+    }
+
+private:
+    // Decoded bytes go straight into a preallocated span; the history stays
+    // where it is and matches reaching before begin are copied from it.
+    struct Output {
+        u8* begin;
+        u8* op;    // next byte to write
+        u8* end;
+        const u8* hist;
+        size_t hist_len;
+        size_t room() const { return size_t(end - op); }
+    };
+
+    static void put_literals(Output& o, const u8* src, size_t len) {
+        if (len > o.room()) throw runtime_error("output overrun");
+        memcpy(o.op, src, len);
+        o.op += len;
+    }
+
+    void check_offset(const Output& o, size_t off) const {
+        if (off == 0 || off > params.window_size || off > size_t(o.op - o.begin) + o.hist_len) throw runtime_error("invalid offset");
+    }
+
+    // The caller has checked the offset and that len bytes fit.
+    static void copy_within(Output& o, size_t off, size_t len) {
+        u8* dst = o.op;
+        o.op += len;
+        size_t done = size_t(dst - o.begin);
+        if (off > done) {
+            // starts in the history; whatever is left continues at begin
+            size_t from_hist = min(off - done, len);
+            memcpy(dst, o.hist + o.hist_len - (off - done), from_hist);
+            dst += from_hist;
+            len -= from_hist;
+        }
+        const u8* from = dst - off;
+        if (off >= len) { memcpy(dst, from, len); return; }
+        if (off == 1) { memset(dst, from[0], len); return; }
+        // overlapping: repeat the last off bytes, doubling the copied span each step
+        memcpy(dst, from, off);
+        for (size_t done = off; done < len; done *= 2) memcpy(dst + done, dst, min(done, len - done));
+    }
+
+    // Fast-loop copy: the caller has checked the offset and that len +
+    // wild_slack bytes are free. Matches reaching into the history are rare
+    // and take the exact path.
+    static void copy_match_fast(Output& o, size_t off, size_t len) {
+        if (off > size_t(o.op - o.begin)) { copy_within(o, off, len); return; }
+        wild_match(o.op, off, len);
+        o.op += len;
+    }
+
+    void copy_match(Output& o, size_t off, size_t len) const {
+        check_offset(o, off);
+        if (len > o.room()) throw runtime_error("output overrun");
+        copy_within(o, off, len);
+    }
+
+    static size_t get_match_len(const vector<u8>& input, size_t& pos) {
+        if (pos >= input.size()) throw runtime_error("corrupt match");
+        u8 len = input[pos++];
+        return len ? len : (size_t)get_varint(input, pos);
+    }
+
+    void decode_flag(const vector<u8>& input, size_t pos, Output& out) const {
         size_t n = input.size();
-        size_t pos = 0;
+        RepOffsets reps;
         while (pos < n) {
-            size_t best_off = 0, best_len = 0;
-            size_t start = (pos > window_size) ? pos - window_size : 0;
-            // naive search (O(W * L)) - okay for chunk sizes like 1MB
-            for (size_t i = start; i < pos; ++i) {
-                size_t len = 0;
-                while (len < lookahead && pos + len < n && input[i + len] == input[pos + len]) ++len;
-                if (len > best_len) { best_len = len; best_off = pos - i; }
-                if (best_len == lookahead) break;
-            }
-            if (best_len >= 3) {
-                // emit match token
-                out.push_back(0x01);
-                u16 off = (u16)best_off; // fits window_size
-                out.push_back((off >> 8) & 0xFF);
-                out.push_back(off & 0xFF);
-                u8 llen = (u8)min<size_t>(best_len, 255);
-                out.push_back(llen);
-                pos += best_len;
-            } else {
-                // literal
-                out.push_back(0x00);
-                out.push_back(input[pos]);
+            u8 flag = input[pos++];
+            if (flag == 0x00) {
+                if (pos >= n) throw runtime_error("corrupt literal");
+                put_literals(out, input.data() + pos, 1);
                 ++pos;
+            } else if (flag == 0x01) {
+                size_t off;
+                if (format == TokenFormat::Mtc1) {
+                    if (pos + 2 > n) throw runtime_error("corrupt match");
+                    off = (u16(input[pos]) << 8) | u16(input[pos+1]); pos += 2;
+                } else {
+                    off = reps.decode(get_varint(input, pos));
+                }
+                size_t len = get_match_len(input, pos);
+                copy_match(out, off, len);
+            } else {
+                throw runtime_error("unknown token flag");
             }
         }
-        return out;
     }
 
-    vector<u8> decompress(const vector<u8>& input){
-        vector<u8> out;
-        size_t pos = 0, n = input.size();
-        while (pos < n) {
-            u8 flag = input[pos++];
-            if (flag == 0x00) {
-                if (pos >= n) throw runtime_error("corrupt literal");
-                out.push_back(input[pos++]);
-            } else if (flag == 0x01) {
-                if (pos + 3 > n) throw runtime_error("corrupt match");
-                u16 off = (u16(input[pos]) << 8) | u16(input[pos+1]); pos += 2;
-                u8 len = input[pos++];
-                if (off == 0 || off > out.size()) throw runtime_error("invalid offset");
-                size_t start = out.size() - off;
-                for (size_t i = 0; i < len; ++i) {
-                    out.push_back(out[start + i]);
+    void decode_sequence(const vector<u8>& input, size_t pos, Output& out) const {
+        size_t n = input.size();
+        const u8* in = input.data();
+        auto get_extra = [&](size_t v) {
+            for (;;) {
+                if (pos >= n) throw runtime_error("corrupt length");
+                u8 b = in[pos++];
+                v += b;
+                if (b != 255) return v;
+            }
+        };
+        RepOffsets reps;
+        // one sequence with every check; false after the final literals-only one
+        auto step = [&]() {
+            u8 token = in[pos++];
+            size_t lits = token >> 4;
+            if (lits == 15) lits = get_extra(lits);
+            if (lits > n - pos) throw runtime_error("corrupt literals");
+            put_literals(out, in + pos, lits);
+            pos += lits;
+            if (pos == n) return false; // last sequence: literals only
+            size_t off = reps.decode(get_varint(input, pos));
+            size_t len = token & 15;
+            if (len == 15) len = get_extra(len);
+            copy_match(out, off, len + min_match);
+            return true;
+        };
+        // Fast loop: with 64 bytes of input and output left, a sequence with
+        // short literals and a short match (no extra length bytes) cannot
+        // cross either end even with wild copies, so only its offset is checked.
+        const size_t margin = 64;
+        while (n - pos >= margin && out.room() >= margin) {
+            u8 token = in[pos];
+            size_t lits = token >> 4, len = token & 15;
+            if (lits == 15 || len == 15) { if (!step()) return; continue; }
+            ++pos;
+            copy16(out.op, in + pos);
+            out.op += lits;
+            pos += lits;
+            size_t off = reps.decode(get_varint_fast(in, pos));
+            check_offset(out, off);
+            copy_match_fast(out, off, len + min_match);
+        }
+        while (pos < n && step()) {}
+    }
+
+    void decode_bitmap(const vector<u8>& input, size_t pos, Output& out) const {
+        size_t n = input.size();
+        const u8* in = input.data();
+        RepOffsets reps;
+        // tokens slot..15 of the group with control word ctrl, with every check
+        auto careful_slots = [&](u32 ctrl, unsigned slot) {
+            while (slot < 16 && pos < n) {
+                if (!((ctrl >> slot) & 1)) {
+                    // literals up to the next match bit (or the end of the group)
+                    size_t run = ctz32((ctrl >> slot) | (1u << (16 - slot)));
+                    size_t take = min(run, n - pos);
+                    put_literals(out, in + pos, take);
+                    pos += take;
+                    slot += (unsigned)run;
+                    continue;
+                }
+                size_t off = reps.decode(get_varint(input, pos));
+                size_t len = get_match_len(input, pos);
+                copy_match(out, off, len);
+                ++slot;
+            }
+        };
+        // Fast loop: the next group (control word, then 16 tokens of at most
+        // a varint offset, a length byte and a varint length) is all in the
+        // input, and 16 matches of up to 255 bytes fit in the output, both
+        // with room for wild copies, so only offsets and varint lengths are
+        // checked. A varint-length match can use up that room, so the rest
+        // of its group goes through the careful path unless enough is left.
+        const size_t group_in = 2 + 16 * (2 * max_varint_size + 1) + wild_slack;
+        const size_t group_out = 16 * 255 + wild_slack;
+        while (n - pos >= group_in && out.room() >= group_out) {
+            u32 ctrl = u32(in[pos]) | (u32(in[pos+1]) << 8);
+            pos += 2;
+            for (unsigned slot = 0; slot < 16; ) {
+                if (!((ctrl >> slot) & 1)) {
+                    size_t run = ctz32((ctrl >> slot) | (1u << (16 - slot)));
+                    copy16(out.op, in + pos);
+                    out.op += run;
+                    pos += run;
+                    slot += (unsigned)run;
+                    continue;
+                }
+                size_t off = reps.decode(get_varint_fast(in, pos));
+                size_t len = in[pos++];
+                if (len) {
+                    check_offset(out, off);
+                    copy_match_fast(out, off, len);
+                } else {
+                    copy_match(out, off, (size_t)get_varint_fast(in, pos));
+                    if (out.room() < group_out) { careful_slots(ctrl, slot + 1); break; }
+                }
+                ++slot;
+            }
+        }
+        while (pos < n) {
+            if (pos + 2 > n) throw runtime_error("corrupt control word");
+            u32 ctrl = u32(in[pos]) | (u32(in[pos+1]) << 8);
+            pos += 2;
+            careful_slots(ctrl, 0);
+        }
+    }
+
+    void decode_entropy(const vector<u8>& input, size_t pos, bool fse, Output& out) const {
+        u64 nlits = get_varint(input, pos);
+        u64 nseqs = get_varint(input, pos);
+        // every symbol takes at least one bit
+        if (nlits > u64(input.size()) * 8 || nseqs > u64(input.size()) * 8) throw runtime_error("corrupt entropy block");
+        HuffmanTable lit, ll, ml, of;
+        FseTable fll, fml, fof;
+        lit.read(input, pos, 256);
+        if (fse) {
+            fll.read(input, pos, value_code_count);
+            fml.read(input, pos, value_code_count);
+            fof.read(input, pos, value_code_count);
+        } else {
+            ll.read(input, pos, value_code_count);
+            ml.read(input, pos, value_code_count);
+            of.read(input, pos, value_code_count);
+        }
+
+        u64 lit_bytes = get_varint(input, pos);
+        if (lit_bytes > input.size() - pos) throw runtime_error("corrupt entropy block");
+        size_t nl = (size_t)nlits;
+        vector<u8> lits(nl + wild_slack); // slack for wild literal copies
+        BitReader lr(input.data() + pos, input.data() + pos + lit_bytes);
+        lit.decode_bytes(lr, lits.data(), nl);
+        pos += (size_t)lit_bytes;
+
+        BitReader br(input.data() + pos, input.data() + input.size());
+        size_t lp = 0;
+        RepOffsets reps;
+        auto execute = [&](size_t ll_v, size_t ml_v, size_t code) {
+            if (ll_v > nl - lp) throw runtime_error("corrupt literals");
+            if (ml_v > out.room() || ll_v > out.room() - ml_v) throw runtime_error("output overrun");
+            // wild copies while the sequence leaves wild_slack bytes free
+            bool wild = out.room() - ml_v - ll_v >= wild_slack;
+            if (wild) wild_copy(out.op, lits.data() + lp, ll_v);
+            else memcpy(out.op, lits.data() + lp, ll_v);
+            out.op += ll_v;
+            lp += ll_v;
+            size_t off = reps.decode(code);
+            check_offset(out, off);
+            if (wild) copy_match_fast(out, off, ml_v);
+            else copy_within(out, off, ml_v);
+        };
+        if (fse && nseqs) {
+            u32 sll = br.get(fll.table_log), sml = br.get(fml.table_log), sof = br.get(fof.table_log);
+            for (u64 k = 0; k < nseqs; ++k) {
+                u32 cll = fll.dtable[sll].sym, cml = fml.dtable[sml].sym, cof = fof.dtable[sof].sym;
+                size_t ll_v = value_from_code(cll, br);
+                size_t ml_v = value_from_code(cml, br) + min_match;
+                size_t off = value_from_code(cof, br);
+                fll.decode(sll, br); fml.decode(sml, br); fof.decode(sof, br);
+                execute(ll_v, ml_v, off);
+            }
+        } else {
+            for (u64 k = 0; k < nseqs; ++k) {
+                size_t ll_v = value_from_code(ll.decode(br), br);
+                size_t ml_v = value_from_code(ml.decode(br), br) + min_match;
+                size_t off = value_from_code(of.decode(br), br);
+                execute(ll_v, ml_v, off);
+            }
+        }
+        put_literals(out, lits.data() + lp, nl - lp);
+    }
+};
+
+// ---------------------- Long-range matcher ----------------------
+// Finds repeats far beyond the LZ77 window, like zstd --long. A rolling hash
+// over min_len-byte spans picks content-defined sample positions, so both
+// copies of a repeat are sampled at the same place; sampled positions go into
+// a table keyed by the hash. Hits are verified and extended in a ring buffer
+// holding the last 2^window_log bytes of the file. The pass runs over the
+// chunks in file order before they are handed to the workers: matches are cut
+// out of each chunk and LZ77 only sees what is left (the residual).
+struct LongMatch {
+    u32 pos;  // start within the chunk
+    u32 len;
+    u64 dist; // distance back in the file
+};
+
+struct LongRangeMatcher {
+    static constexpr size_t min_len = 64;  // also the span of the rolling hash
+    static constexpr int select_bits = 5;  // sample one position in 32
+    static constexpr u64 prime = 0x100000001B3ull;
+
+    u64 window = 0;
+    vector<u8> ring;    // byte at file offset x lives at ring[x & ring_mask]
+    u64 ring_mask = 0;
+    vector<u64> table;  // sampled hash -> file offset + 1
+    int table_bits = 0;
+    u64 consumed = 0;   // file bytes seen so far
+    u64 pow_out = 1;    // prime^(min_len - 1), removes the outgoing byte
+
+    void reset(int window_log, u64 file_size, size_t chunk_size) {
+        window = u64(1) << window_log;
+        u64 need = min<u64>(file_size, window + chunk_size);
+        int ring_log = 0;
+        while ((u64(1) << ring_log) < need) ++ring_log;
+        ring.assign(size_t(1) << ring_log, 0);
+        ring_mask = ring.size() - 1;
+        table_bits = clamp(ring_log - select_bits, 10, 24);
+        table.assign(size_t(1) << table_bits, 0);
+        consumed = 0;
+        pow_out = 1;
+        for (size_t i = 1; i < min_len; ++i) pow_out *= prime;
+    }
+
+    // Equal bytes at file offsets a < b, both still in the ring.
+    size_t ring_match(u64 a, u64 b, size_t limit) const {
+        size_t len = 0;
+        while (len < limit) {
+            size_t ia = (size_t)((a + len) & ring_mask), ib = (size_t)((b + len) & ring_mask);
+            size_t run = min({limit - len, ring.size() - ia, ring.size() - ib});
+            size_t m = match_length(&ring[ia], &ring[ib], run);
+            len += m;
+            if (m < run) break;
+        }
+        return len;
+    }
+
+    // chunk is the next part of the file. Long matches never cross its end.
+    void process(const vector<u8>& chunk, vector<LongMatch>& matches, vector<u8>& residual) {
+        matches.clear();
+        residual.clear();
+        u64 base = consumed;
+        size_t n = chunk.size();
+        for (size_t done = 0; done < n; ) {
+            size_t at = (size_t)((base + done) & ring_mask);
+            size_t run = min(n - done, ring.size() - at);
+            memcpy(&ring[at], chunk.data() + done, run);
+            done += run;
+        }
+        consumed += n;
+        u64 oldest = consumed > ring.size() ? consumed - ring.size() : 0;
+        size_t anchor = 0; // residual continues from here
+        if (n >= min_len) {
+            u64 h = 0;
+            for (size_t i = 0; i < min_len; ++i) h = h * prime + chunk[i];
+            for (size_t p = 0; ; ++p) {
+                u64 mixed = h * 0x9E3779B97F4A7C15ull;
+                if ((mixed >> (64 - select_bits)) == 0) {
+                    size_t key = (size_t)(mixed >> (64 - select_bits - table_bits)) & (table.size() - 1);
+                    u64 cur = base + p;
+                    u64 cand = table[key];
+                    table[key] = cur + 1;
+                    if (cand && p >= anchor && cand - 1 >= oldest && cur - (cand - 1) <= window) {
+                        u64 src = cand - 1;
+                        size_t fwd = ring_match(src, cur, n - p);
+                        if (fwd >= min_len) {
+                            size_t back = 0;
+                            while (p - back > anchor && src - back > oldest &&
+                                   ring[(size_t)((src - back - 1) & ring_mask)] == chunk[p - back - 1]) ++back;
+                            matches.push_back({(u32)(p - back), (u32)(fwd + back), cur - src});
+                            residual.insert(residual.end(), chunk.begin() + anchor, chunk.begin() + (p - back));
+                            anchor = p + fwd;
+                        }
+                    }
                 }
-            } else {
-                throw runtime_error("unknown token flag");
+                if (p + min_len >= n) break;
+                h = (h - chunk[p] * pow_out) * prime + chunk[p + min_len];
             }
         }
-        return out;
+        residual.insert(residual.end(), chunk.begin() + anchor, chunk.end());
+    }
+};
+
+// Long matches are stored in front of the chunk's LZ77 stream:
+// varint count, then per match varint gap (bytes since the previous match
+// ended), varint distance, varint length.
+static void put_long_matches(vector<u8>& out, const vector<LongMatch>& matches) {
+    put_varint(out, matches.size());
+    u64 prev_end = 0;
+    for (const LongMatch& m : matches) {
+        put_varint(out, m.pos - prev_end);
+        put_varint(out, m.dist);
+        put_varint(out, m.len);
+        prev_end = u64(m.pos) + m.len;
+    }
+}
+
+static vector<LongMatch> get_long_matches(const vector<u8>& in, size_t& pos) {
+    u64 cnt = get_varint(in, pos);
+    if (cnt > in.size()) throw runtime_error("corrupt long match list");
+    vector<LongMatch> matches((size_t)cnt);
+    u64 prev_end = 0;
+    for (LongMatch& m : matches) {
+        u64 start = prev_end + get_varint(in, pos);
+        m.dist = get_varint(in, pos);
+        u64 len = get_varint(in, pos);
+        if (start + len > UINT32_MAX) throw runtime_error("corrupt long match list");
+        m.pos = (u32)start;
+        m.len = (u32)len;
+        prev_end = start + len;
+    }
+    return matches;
+}
+
+// Rebuilds a chunk from its residual. chunk_base is the chunk's offset in the
+// file; sources before it are fetched with read_history(offset, dst, len).
+static vector<u8> splice_long_matches(const vector<u8>& residual, const vector<LongMatch>& matches,
+                                      u64 chunk_base, u64 orig,
+                                      const function<void(u64, u8*, size_t)>& read_history) {
+    vector<u8> out;
+    out.reserve((size_t)orig);
+    size_t r = 0;
+    for (const LongMatch& m : matches) {
+        if (m.pos < out.size() || m.pos - out.size() > residual.size() - r) throw runtime_error("corrupt long match");
+        size_t gap = m.pos - out.size();
+        out.insert(out.end(), residual.begin() + r, residual.begin() + r + gap);
+        r += gap;
+        if (out.size() + m.len > orig) throw runtime_error("corrupt long match");
+        u64 here = chunk_base + out.size();
+        if (m.dist == 0 || m.dist > here) throw runtime_error("invalid long match distance");
+        u64 src = here - m.dist;
+        size_t len = m.len;
+        if (src < chunk_base) {
+            size_t from_file = (size_t)min<u64>(len, chunk_base - src);
+            size_t at = out.size();
+            out.resize(at + from_file);
+            read_history(src, out.data() + at, from_file);
+            src += from_file;
+            len -= from_file;
+        }
+        size_t from = (size_t)(src - chunk_base);
+        for (size_t k = 0; k < len; ++k) out.push_back(out[from + k]);
     }
+    out.insert(out.end(), residual.begin() + r, residual.end());
+    return out;
+}
+
+// ---------------------- Filters ----------------------
+// Reversible per-chunk transforms that run before LZ77 and are undone after
+// it, turning data that LZ77 handles badly into something that repeats.
+// X86: the 32-bit displacement after E8/E9 (call/jmp rel32) is made absolute
+//   when it fits in 25 bits, so calls to one target become identical bytes.
+//   Results are kept to 25 bits sign-extended, so the decoder recognises
+//   exactly the same places without any side information. An opcode that is
+//   left alone blocks conversions in the next 3 bytes: those would rewrite
+//   its high byte and make the decoder see a convertible call there.
+// Delta: every byte is replaced by its difference to the byte `stride`
+//   earlier, for tables of slowly changing numbers.
+// Shuffle: byte b of every `size`-byte element goes to plane b, so the
+//   repetitive high bytes of numeric records end up next to each other.
+enum class FilterType : u8 { X86 = 1, Delta = 2, Shuffle = 3 };
+
+struct Filter {
+    FilterType type;
+    u8 param = 0; // Delta: stride in bytes (1..255), Shuffle: element size (2..255)
 };
 
+static constexpr size_t max_filters = 4;
+
+static void x86_convert(u8* buf, size_t n, bool encode) {
+    if (n < 5) return;
+    size_t end = n - 4; // an opcode needs 4 displacement bytes after it
+    size_t i = 0, next_ok = 0;
+    while (i < end) {
+#if defined(MTC_SSE2)
+        // skip 16 bytes at a time while none of them is E8 or E9
+        if (i + 16 <= end) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+            __m128i op = _mm_and_si128(v, _mm_set1_epi8((char)0xFE));
+            u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(op, _mm_set1_epi8((char)0xE8)));
+            if (!mask) { i += 16; continue; }
+            i += ctz32(mask);
+        }
+#endif
+        if ((buf[i] & 0xFE) != 0xE8) { ++i; continue; }
+        u8* p = buf + i + 1;
+        if (i < next_ok || (p[3] != 0x00 && p[3] != 0xFF)) { next_ok = i + 4; ++i; continue; }
+        u32 v = u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+        u32 at = (u32)(i + 5); // the displacement is relative to the next instruction
+        v = encode ? v + at : v - at;
+        v &= 0x01FFFFFFu;
+        if (v & 0x01000000u) v |= 0xFE000000u;
+        p[0] = u8(v); p[1] = u8(v >> 8); p[2] = u8(v >> 16); p[3] = u8(v >> 24);
+        i += 5;
+    }
+}
+
+static void delta_encode(u8* buf, size_t n, size_t stride) {
+    // back to front, so every byte still sees its original predecessor
+    size_t i = n;
+#if defined(__AVX2__)
+    while (i >= stride + 32) {
+        i -= 32;
+        __m256i cur = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i*)(buf + i - stride));
+        _mm256_storeu_si256((__m256i*)(buf + i), _mm256_sub_epi8(cur, prev));
+    }
+#endif
+#if defined(MTC_SSE2)
+    while (i >= stride + 16) {
+        i -= 16;
+        __m128i cur = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i prev = _mm_loadu_si128((const __m128i*)(buf + i - stride));
+        _mm_storeu_si128((__m128i*)(buf + i), _mm_sub_epi8(cur, prev));
+    }
+#endif
+    while (i > stride) { --i; buf[i] = u8(buf[i] - buf[i - stride]); }
+}
+
+static void delta_decode(u8* buf, size_t n, size_t stride) {
+    size_t i = stride;
+    // a vector of bytes can be summed at once when its predecessors are all done
+#if defined(__AVX2__)
+    if (stride >= 32) {
+        for (; i + 32 <= n; i += 32) {
+            __m256i cur = _mm256_loadu_si256((const __m256i*)(buf + i));
+            __m256i prev = _mm256_loadu_si256((const __m256i*)(buf + i - stride));
+            _mm256_storeu_si256((__m256i*)(buf + i), _mm256_add_epi8(cur, prev));
+        }
+    }
+#endif
+#if defined(MTC_SSE2)
+    if (stride >= 16) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(buf + i));
+            __m128i prev = _mm_loadu_si128((const __m128i*)(buf + i - stride));
+            _mm_storeu_si128((__m128i*)(buf + i), _mm_add_epi8(cur, prev));
+        }
+    }
+#endif
+    for (; i < n; ++i) buf[i] = u8(buf[i] + buf[i - stride]);
+}
+
+// Shuffle transpose in vectors: a round splits pairs of vectors into their
+// even and odd bytes, and log2(es) rounds turn es vectors of elements into
+// es byte planes. join_round undoes one round.
+#if defined(__AVX2__)
+static void split_round(__m256i* r, size_t es) {
+    __m256i tmp[16];
+    const __m256i lo = _mm256_set1_epi16(0x00FF);
+    size_t h = es / 2;
+    for (size_t j = 0; j < h; ++j) {
+        __m256i a = r[2 * j], b = r[2 * j + 1];
+        // packs work per 128-bit lane, the permute puts the halves in order
+        tmp[j] = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a, lo), _mm256_and_si256(b, lo)), 0xD8);
+        tmp[h + j] = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xD8);
+    }
+    for (size_t j = 0; j < es; ++j) r[j] = tmp[j];
+}
+
+static void join_round(__m256i* r, size_t es) {
+    __m256i tmp[16];
+    size_t h = es / 2;
+    for (size_t j = 0; j < h; ++j) {
+        __m256i lo = _mm256_unpacklo_epi8(r[j], r[h + j]);
+        __m256i hi = _mm256_unpackhi_epi8(r[j], r[h + j]);
+        tmp[2 * j] = _mm256_permute2x128_si256(lo, hi, 0x20);
+        tmp[2 * j + 1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+    }
+    for (size_t j = 0; j < es; ++j) r[j] = tmp[j];
+}
+#endif
+
+#if defined(MTC_SSE2)
+static void split_round(__m128i* r, size_t es) {
+    __m128i tmp[16];
+    const __m128i lo = _mm_set1_epi16(0x00FF);
+    size_t h = es / 2;
+    for (size_t j = 0; j < h; ++j) {
+        __m128i a = r[2 * j], b = r[2 * j + 1];
+        tmp[j] = _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo));
+        tmp[h + j] = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    }
+    for (size_t j = 0; j < es; ++j) r[j] = tmp[j];
+}
+
+static void join_round(__m128i* r, size_t es) {
+    __m128i tmp[16];
+    size_t h = es / 2;
+    for (size_t j = 0; j < h; ++j) {
+        tmp[2 * j] = _mm_unpacklo_epi8(r[j], r[h + j]);
+        tmp[2 * j + 1] = _mm_unpackhi_epi8(r[j], r[h + j]);
+    }
+    for (size_t j = 0; j < es; ++j) r[j] = tmp[j];
+}
+#endif
+
+// Element sizes 2, 4, 8 and 16 are vectorised, others use the byte loop.
+// Bytes after the last whole element stay where they are.
+static void shuffle_encode(vector<u8>& data, size_t es) {
+    size_t m = data.size() / es; // elements
+    if (m < 2) return;
+    vector<u8> out(data.size());
+    const u8* src = data.data();
+    u8* dst = out.data();
+    size_t e = 0;
+    bool vec = es <= 16 && (es & (es - 1)) == 0;
+    int rounds = (int)ctz32((u32)es);
+#if defined(__AVX2__)
+    if (vec) {
+        for (; e + 32 <= m; e += 32) {
+            __m256i r[16];
+            for (size_t j = 0; j < es; ++j) r[j] = _mm256_loadu_si256((const __m256i*)(src + e * es + 32 * j));
+            for (int k = 0; k < rounds; ++k) split_round(r, es);
+            for (size_t j = 0; j < es; ++j) _mm256_storeu_si256((__m256i*)(dst + j * m + e), r[j]);
+        }
+    }
+#endif
+#if defined(MTC_SSE2)
+    if (vec) {
+        for (; e + 16 <= m; e += 16) {
+            __m128i r[16];
+            for (size_t j = 0; j < es; ++j) r[j] = _mm_loadu_si128((const __m128i*)(src + e * es + 16 * j));
+            for (int k = 0; k < rounds; ++k) split_round(r, es);
+            for (size_t j = 0; j < es; ++j) _mm_storeu_si128((__m128i*)(dst + j * m + e), r[j]);
+        }
+    }
+#endif
+    (void)vec; (void)rounds;
+    for (size_t b = 0; b < es; ++b)
+        for (size_t k = e; k < m; ++k) dst[b * m + k] = src[k * es + b];
+    memcpy(dst + m * es, src + m * es, data.size() - m * es);
+    data.swap(out);
+}
+
+static void shuffle_decode(vector<u8>& data, size_t es) {
+    size_t m = data.size() / es;
+    if (m < 2) return;
+    vector<u8> out(data.size());
+    const u8* src = data.data();
+    u8* dst = out.data();
+    size_t e = 0;
+    bool vec = es <= 16 && (es & (es - 1)) == 0;
+    int rounds = (int)ctz32((u32)es);
+#if defined(__AVX2__)
+    if (vec) {
+        for (; e + 32 <= m; e += 32) {
+            __m256i r[16];
+            for (size_t j = 0; j < es; ++j) r[j] = _mm256_loadu_si256((const __m256i*)(src + j * m + e));
+            for (int k = 0; k < rounds; ++k) join_round(r, es);
+            for (size_t j = 0; j < es; ++j) _mm256_storeu_si256((__m256i*)(dst + e * es + 32 * j), r[j]);
+        }
+    }
+#endif
+#if defined(MTC_SSE2)
+    if (vec) {
+        for (; e + 16 <= m; e += 16) {
+            __m128i r[16];
+            for (size_t j = 0; j < es; ++j) r[j] = _mm_loadu_si128((const __m128i*)(src + j * m + e));
+            for (int k = 0; k < rounds; ++k) join_round(r, es);
+            for (size_t j = 0; j < es; ++j) _mm_storeu_si128((__m128i*)(dst + e * es + 16 * j), r[j]);
+        }
+    }
+#endif
+    (void)vec; (void)rounds;
+    for (size_t k = e; k < m; ++k)
+        for (size_t b = 0; b < es; ++b) dst[k * es + b] = src[b * m + k];
+    memcpy(dst + m * es, src + m * es, data.size() - m * es);
+    data.swap(out);
+}
+
+static void apply_filters(const vector<Filter>& chain, vector<u8>& data) {
+    for (const Filter& f : chain) {
+        if (f.type == FilterType::X86) x86_convert(data.data(), data.size(), true);
+        else if (f.type == FilterType::Delta) delta_encode(data.data(), data.size(), f.param);
+        else shuffle_encode(data, f.param);
+    }
+}
+
+static void undo_filters(const vector<Filter>& chain, vector<u8>& data) {
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        if (it->type == FilterType::X86) x86_convert(data.data(), data.size(), false);
+        else if (it->type == FilterType::Delta) delta_decode(data.data(), data.size(), it->param);
+        else shuffle_decode(data, it->param);
+    }
+}
+
+// "x86", "delta:<stride>" or "shuffle:<element size>"
+// Command-line numbers are plain decimal; what names the value in the error.
+static bool is_number(const string& s) {
+    return !s.empty() && all_of(s.begin(), s.end(), [](char c) { return isdigit((unsigned char)c); });
+}
+static u64 parse_number(const string& s, const string& what) {
+    if (!is_number(s) || s.size() > 19) throw runtime_error("invalid " + what + ": " + s);
+    return stoull(s);
+}
+
+static Filter parse_filter(const string& spec) {
+    if (spec == "x86") return {FilterType::X86, 0};
+    if (spec.rfind("delta:", 0) == 0) {
+        u64 stride = parse_number(spec.substr(6), "delta stride");
+        if (stride < 1 || stride > 255) throw runtime_error("delta stride must be between 1 and 255");
+        return {FilterType::Delta, (u8)stride};
+    }
+    if (spec.rfind("shuffle:", 0) == 0) {
+        u64 size = parse_number(spec.substr(8), "shuffle element size");
+        if (size < 2 || size > 255) throw runtime_error("shuffle element size must be between 2 and 255");
+        return {FilterType::Shuffle, (u8)size};
+    }
+    throw runtime_error("unknown filter " + spec);
+}
+
 // ---------------------- File helpers ----------------------
+static int seek64(FILE* f, u64 offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(f, (long long)offset, whence);
+#else
+    return fseeko(f, (off_t)offset, whence);
+#endif
+}
+
+static u64 tell64(FILE* f) {
+#ifdef _WIN32
+    return (u64)_ftelli64(f);
+#else
+    return (u64)ftello(f);
+#endif
+}
+
 static vector<u8> read_file_chunk(const string& filename, u64 offset, size_t size) {
     FILE* f = fopen(filename.c_str(), "rb");
     if (!f) return {};
-    if (fseek(f, (long)offset, SEEK_SET) != 0) { fclose(f); return {}; }
+    if (seek64(f, offset, SEEK_SET) != 0) { fclose(f); return {}; }
     vector<u8> buf; buf.resize(size);
     size_t r = fread(buf.data(), 1, size, f);
     buf.resize(r);
@@ -143,55 +2206,832 @@ static vector<u8> read_file_chunk(const string& filename, u64 offset, size_t siz
 static u64 file_size(const string& filename) {
     FILE* f = fopen(filename.c_str(), "rb");
     if (!f) return 0;
-    if (fseek(f, 0, SEEK_END) != 0) { fclose(f); return 0; }
-    long s = ftell(f);
+    if (seek64(f, 0, SEEK_END) != 0) { fclose(f); return 0; }
+    u64 s = tell64(f);
+    fclose(f);
+    return s;
+}
+
+// ---------------------- Dictionaries ----------------------
+// A dictionary is typical content preloaded as window history, so small
+// inputs can match against it from their first byte. File layout: magic
+// 'MTCD', u32 id, then the content. Containers record the id they need.
+struct Dictionary {
+    u32 id = 0;
+    vector<u8> content;
+};
+
+static constexpr size_t default_dict_size = 110 << 10;
+
+// FNV-1a over the content; never 0.
+static u32 dictionary_id(const vector<u8>& content) {
+    u32 h = 2166136261u;
+    for (u8 b : content) h = (h ^ b) * 16777619u;
+    return h ? h : 1;
+}
+
+static Dictionary load_dictionary(const string& filename) {
+    u64 size = file_size(filename);
+    vector<u8> raw = size >= 8 ? read_file_chunk(filename, 0, (size_t)size) : vector<u8>();
+    if (raw.size() < 8 || raw.size() != size || memcmp(raw.data(), "MTCD", 4) != 0)
+        throw runtime_error("not a dictionary file: " + filename);
+    Dictionary d;
+    memcpy(&d.id, raw.data() + 4, 4);
+    d.content.assign(raw.begin() + 8, raw.end());
+    return d;
+}
+
+static void save_dictionary(const string& filename, const Dictionary& d) {
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) throw runtime_error("cannot open dictionary file");
+    fwrite("MTCD", 1, 4, f);
+    fwrite(&d.id, sizeof(u32), 1, f);
+    if (!d.content.empty()) fwrite(d.content.data(), 1, d.content.size(), f);
     fclose(f);
-    return (u64) s;
 }
 
-static void write_all(const string& filename, const vector<vector<u8>>& chunks, const vector<u64>& original_sizes) {
-    // Format: magic 'MTC1' (4 bytes)
+// Builds a dictionary of at most dict_size bytes from samples, COVER-style:
+// every 8-byte string (d-mer) is scored by the number of samples containing
+// it, the samples are split into one epoch per segment, and each epoch
+// contributes the segment whose distinct d-mers score highest. The d-mers of
+// a chosen segment then score zero, so later segments add new content.
+// Segments fill the dictionary from the back.
+static vector<u8> train_dictionary(const vector<vector<u8>>& samples, size_t dict_size) {
+    constexpr size_t d = 8, k = 256;
+    constexpr int hash_bits = 22;
+    vector<u8> all;
+    for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+    if (all.size() <= dict_size) return all;
+
+    auto hash = [&](size_t pos) { return size_t((load64(all.data() + pos) * 0x9E3779B97F4A7C15ull) >> (64 - hash_bits)); };
+    vector<u32> freq(size_t(1) << hash_bits), seen(size_t(1) << hash_bits, UINT32_MAX);
+    size_t base = 0;
+    for (u32 s = 0; s < samples.size(); ++s) {
+        for (size_t p = 0; p + d <= samples[s].size(); ++p) {
+            size_t h = hash(base + p);
+            if (seen[h] != s) { seen[h] = s; ++freq[h]; }
+        }
+        base += samples[s].size();
+    }
+
+    size_t dmers = all.size() - d + 1;
+    size_t epochs = max<size_t>(1, dict_size / k);
+    size_t epoch_len = max(k, dmers / epochs);
+    vector<u16> active(size_t(1) << hash_bits); // d-mers inside the current window
+    vector<u8> dict(dict_size);
+    size_t fill = dict_size;
+    for (size_t e = 0; e < dmers && fill > 0; e += epoch_len) {
+        size_t end = min(dmers, e + epoch_len);
+        // slide a window of k - d + 1 d-mers over the epoch
+        size_t span = k - d + 1, best = e, best_score = 0, score = 0;
+        for (size_t p = e; p < end; ++p) {
+            size_t h = hash(p);
+            if (active[h]++ == 0) score += freq[h];
+            if (p >= e + span) {
+                size_t o = hash(p - span);
+                if (--active[o] == 0) score -= freq[o];
+            }
+            if (p + 1 >= e + span && score > best_score) { best_score = score; best = p + 1 - span; }
+        }
+        for (size_t p = max(e, end >= span ? end - span : 0); p < end; ++p) --active[hash(p)];
+        if (best_score == 0) continue;
+        size_t len = min({k, fill, all.size() - best});
+        fill -= len;
+        memcpy(dict.data() + fill, all.data() + best, len);
+        for (size_t p = best; p + d <= best + len; ++p) freq[hash(p)] = 0;
+    }
+    dict.erase(dict.begin(), dict.begin() + fill);
+    return dict;
+}
+
+// Container-level settings the decompressor needs before decoding any chunk.
+enum : u8 {
+    flag_linked = 1 << 0, // chunk i uses the tail of chunk i-1 as window history
+    flag_long   = 1 << 1, // chunks start with a long-range match list
+    flag_dict   = 1 << 2, // chunks without other history start from a dictionary
+    flag_filters = 1 << 3, // chunks are filtered before LZ77 (see Filters)
+    flag_seek_table = 1 << 4, // a chunk index follows the chunks
+};
+
+struct ContainerHeader {
+    u8 window_log = 12; // matches reach at most 1 << window_log bytes back
+    u8 flags = 0;
+    TokenFormat format = TokenFormat::Bitmap;
+    u32 dict_id = 0;    // with flag_dict
+    vector<Filter> filters; // with flag_filters, in the order they were applied
+};
+
+// Seek table entry: file position of a chunk record and its original size.
+struct ChunkEntry {
+    u64 pos;
+    u64 orig;
+};
+
+static void write_all(const string& filename, const ContainerHeader& hdr, const vector<vector<u8>>& chunks, const vector<u64>& original_sizes) {
+    // Format: magic 'MTC2' (4 bytes)
+    // u8 window_log, u8 flags, u8 token_format
+    // u32 dict_id (only with flag_dict)
+    // u8 filter_count, then u8 type + u8 param per filter (only with flag_filters)
     // u32 chunk_count
     // For each chunk: u64 original_size, u64 compressed_size, then compressed bytes
+    // (a BlockType byte followed by the token, Huffman, FSE, stored or RLE data)
+    // With flag_seek_table: u64 record_offset + u64 original_size per chunk,
+    // then u64 table_offset and 'MTCS', so the table is found from the end
+    // ('MTC1' files have no window_log byte and use 16-bit offsets.)
     FILE* f = fopen(filename.c_str(), "wb");
     if (!f) throw runtime_error("cannot open output file");
-    fwrite("MTC1", 1, 4, f);
+    fwrite("MTC2", 1, 4, f);
+    fwrite(&hdr.window_log, 1, 1, f);
+    fwrite(&hdr.flags, 1, 1, f);
+    u8 format = (u8)hdr.format;
+    fwrite(&format, 1, 1, f);
+    if (hdr.flags & flag_dict) fwrite(&hdr.dict_id, sizeof(u32), 1, f);
+    if (hdr.flags & flag_filters) {
+        u8 n = (u8)hdr.filters.size();
+        fwrite(&n, 1, 1, f);
+        for (const Filter& flt : hdr.filters) {
+            u8 fb[2] = {(u8)flt.type, flt.param};
+            fwrite(fb, 1, 2, f);
+        }
+    }
     u32 cnt = (u32)chunks.size();
     fwrite(&cnt, sizeof(u32), 1, f);
+    vector<ChunkEntry> index(chunks.size());
     for (size_t i = 0; i < chunks.size(); ++i) {
         u64 orig = original_sizes[i];
         u64 comp = chunks[i].size();
+        index[i] = {tell64(f), orig};
         fwrite(&orig, sizeof(u64), 1, f);
         fwrite(&comp, sizeof(u64), 1, f);
         if (comp) fwrite(chunks[i].data(), 1, comp, f);
     }
+    if (hdr.flags & flag_seek_table) {
+        u64 table_pos = tell64(f);
+        for (const ChunkEntry& e : index) {
+            fwrite(&e.pos, sizeof(u64), 1, f);
+            fwrite(&e.orig, sizeof(u64), 1, f);
+        }
+        fwrite(&table_pos, sizeof(u64), 1, f);
+        fwrite("MTCS", 1, 4, f);
+    }
     fclose(f);
 }
 
-static void read_and_decompress_file(const string& inname, const string& outname) {
-    FILE* f = fopen(inname.c_str(), "rb");
-    if (!f) throw runtime_error("cannot open input file");
+// Reads the container header up to the chunk records and checks that dict
+// (null when none was given) is the one the file needs.
+static ContainerHeader read_header(FILE* f, const Dictionary* dict, u32& cnt) {
     char magic[4]; if (fread(magic,1,4,f)!=4) throw runtime_error("bad file");
-    if (memcmp(magic, "MTC1", 4) != 0) throw runtime_error("not a MTC1 file");
-    u32 cnt; if (fread(&cnt, sizeof(u32), 1, f)!=1) throw runtime_error("bad file header");
-    FILE* out = fopen(outname.c_str(), "wb");
-    if (!out) { fclose(f); throw runtime_error("cannot open output file"); }
+    ContainerHeader hdr;
+    if (memcmp(magic, "MTC1", 4) == 0) {
+        hdr.format = TokenFormat::Mtc1;
+        hdr.window_log = 16;
+    } else if (memcmp(magic, "MTC2", 4) == 0) {
+        if (fread(&hdr.window_log, 1, 1, f) != 1) throw runtime_error("bad file header");
+        if (fread(&hdr.flags, 1, 1, f) != 1) throw runtime_error("bad file header");
+        if (hdr.flags & ~(flag_linked | flag_long | flag_dict | flag_filters | flag_seek_table)) throw runtime_error("unsupported file flags");
+        u8 format;
+        if (fread(&format, 1, 1, f) != 1) throw runtime_error("bad file header");
+        if (format < (u8)TokenFormat::Flag || format > (u8)TokenFormat::Sequence) throw runtime_error("unsupported token format");
+        hdr.format = (TokenFormat)format;
+        if (hdr.window_log < min_window_log || hdr.window_log > max_window_log) throw runtime_error("unsupported window size");
+        if (hdr.flags & flag_dict) {
+            if (fread(&hdr.dict_id, sizeof(u32), 1, f) != 1) throw runtime_error("bad file header");
+            char id[16];
+            snprintf(id, sizeof(id), "%08x", hdr.dict_id);
+            if (!dict) throw runtime_error(string("file needs dictionary ") + id + " (--dict=<file>)");
+            if (dict->id != hdr.dict_id) throw runtime_error(string("wrong dictionary, file needs ") + id);
+        }
+        if (hdr.flags & flag_filters) {
+            u8 n;
+            if (fread(&n, 1, 1, f) != 1) throw runtime_error("bad file header");
+            if (n == 0 || n > max_filters) throw runtime_error("unsupported filter chain");
+            for (u8 k = 0; k < n; ++k) {
+                u8 fb[2];
+                if (fread(fb, 1, 2, f) != 2) throw runtime_error("bad file header");
+                bool ok = fb[0] == (u8)FilterType::X86 || (fb[0] == (u8)FilterType::Delta && fb[1] >= 1)
+                       || (fb[0] == (u8)FilterType::Shuffle && fb[1] >= 2);
+                if (!ok) throw runtime_error("unsupported filter");
+                hdr.filters.push_back({(FilterType)fb[0], fb[1]});
+            }
+        }
+    } else {
+        throw runtime_error("not a MTC1/MTC2 file");
+    }
+    if (fread(&cnt, sizeof(u32), 1, f)!=1) throw runtime_error("bad file header");
+    return hdr;
+}
+
+// File position just past the last chunk record: the seek table's, or the
+// end of the file. Bounds the compressed sizes records may claim.
+static u64 records_end(FILE* f, const ContainerHeader& hdr, u32 cnt) {
+    if (seek64(f, 0, SEEK_END) != 0) throw runtime_error("cannot seek input");
+    u64 size = tell64(f);
+    u64 table_size = (hdr.flags & flag_seek_table) ? u64(cnt) * 16 + 12 : 0;
+    return size > table_size ? size - table_size : 0;
+}
+
+// Where each chunk record starts and how much of the original file it holds:
+// from the seek table when the file has one, otherwise by walking the
+// record headers and seeking over their data.
+static vector<ChunkEntry> read_chunk_index(FILE* f, const ContainerHeader& hdr, u32 cnt, u64 records_start) {
+    if (seek64(f, 0, SEEK_END) != 0) throw runtime_error("cannot seek input");
+    u64 size = tell64(f);
+    // every record has a 16-byte header, so a larger count is corrupt
+    if (size < records_start || u64(cnt) * 16 > size - records_start) throw runtime_error("bad chunk count");
+    vector<ChunkEntry> index(cnt);
+    if (hdr.flags & flag_seek_table) {
+        u64 table_size = u64(cnt) * 16 + 12;
+        if (size < records_start + table_size) throw runtime_error("bad seek table");
+        u64 table_pos; char magic[4];
+        if (seek64(f, size - 12, SEEK_SET) != 0 || fread(&table_pos, sizeof(u64), 1, f) != 1 || fread(magic, 1, 4, f) != 4)
+            throw runtime_error("bad seek table");
+        if (memcmp(magic, "MTCS", 4) != 0 || table_pos != size - table_size) throw runtime_error("bad seek table");
+        if (seek64(f, table_pos, SEEK_SET) != 0) throw runtime_error("bad seek table");
+        u64 prev_end = records_start;
+        for (ChunkEntry& e : index) {
+            if (fread(&e.pos, sizeof(u64), 1, f) != 1 || fread(&e.orig, sizeof(u64), 1, f) != 1) throw runtime_error("bad seek table");
+            if (e.pos < prev_end || e.pos + 16 > table_pos) throw runtime_error("bad seek table");
+            prev_end = e.pos + 16;
+        }
+    } else {
+        u64 pos = records_start;
+        for (ChunkEntry& e : index) {
+            u64 comp;
+            if (seek64(f, pos, SEEK_SET) != 0 || fread(&e.orig, sizeof(u64), 1, f) != 1 || fread(&comp, sizeof(u64), 1, f) != 1)
+                throw runtime_error("bad file");
+            e.pos = pos;
+            pos += 16 + comp;
+        }
+    }
+    return index;
+}
+
+// One chunk decoded by a pool task, on its way to the ordered writer.
+struct DecodedChunk {
+    shared_ptr<const vector<u8>> data; // the chunk, long matches not yet spliced in
+    shared_ptr<const vector<u8>> lz;   // LZ77 output, history of the next linked chunk
+    vector<LongMatch> long_matches;
+};
+
+// history is the previous chunk's LZ77 output, the dictionary or null;
+// size is the chunk's original size, which bounds its LZ77 output.
+static DecodedChunk decode_chunk(const LZ77& codec, const ContainerHeader& hdr, vector<u8>& compbuf, size_t size, const vector<u8>* history) {
+    DecodedChunk c;
+    if (hdr.flags & flag_long) {
+        size_t lz_start = 0;
+        c.long_matches = get_long_matches(compbuf, lz_start);
+        compbuf.erase(compbuf.begin(), compbuf.begin() + lz_start);
+    }
+    vector<u8> decomp;
+    if (hdr.format != TokenFormat::Mtc1 && !compbuf.empty() && compbuf[0] == (u8)BlockType::Stored) {
+        // raw chunk: reuse the read buffer
+        compbuf.erase(compbuf.begin());
+        decomp = move(compbuf);
+    } else {
+        decomp = history ? codec.decompress(compbuf, size, history->data(), history->size())
+                         : codec.decompress(compbuf, size);
+    }
+    // a long-range residual is shorter; the splice is checked by the writer
+    if (!(hdr.flags & flag_long) && decomp.size() != size) throw runtime_error("chunk size mismatch");
+    if (hdr.filters.empty()) {
+        c.data = make_shared<const vector<u8>>(move(decomp));
+        if (hdr.flags & flag_linked) c.lz = c.data;
+        return c;
+    }
+    // linked history is the LZ77 output, before filters are undone
+    if (hdr.flags & flag_linked) c.lz = make_shared<const vector<u8>>(decomp);
+    undo_filters(hdr.filters, decomp);
+    c.data = make_shared<const vector<u8>>(move(decomp));
+    return c;
+}
+
+// Decodes count chunk records starting at file position start (chunk
+// records are contiguous) on the pool. Their output begins at offset
+// first_base of the original file; only the bytes in [from, to) are written
+// to out. Long matches read earlier output back from history_file, which
+// then gets every decoded byte from the start of the file: out itself when
+// it takes everything, else a scratch file. expect, when not null, holds the
+// seek table entries of the chunks; records that disagree with it are
+// rejected. end is where the records end (records_end). Returns the bytes
+// written to out.
+static u64 decode_chunks(FILE* f, const ContainerHeader& hdr, const Dictionary* dict, u64 start, u64 end, u32 count,
+                          u64 first_base, u64 from, u64 to, FILE* out, FILE* history_file, const ChunkEntry* expect) {
     LZ77 codec;
-    for (u32 i = 0; i < cnt; ++i) {
-        u64 orig, comp; 
-        if (fread(&orig, sizeof(u64), 1, f) != 1) throw runtime_error("bad file");
-        if (fread(&comp, sizeof(u64), 1, f) != 1) throw runtime_error("bad file");
-        vector<u8> compbuf; compbuf.resize((size_t)comp);
-        if (comp && fread(compbuf.data(), 1, (size_t)comp, f) != comp) throw runtime_error("bad file read");
-        auto decomp = codec.decompress(compbuf);
-        if (decomp.size() != orig) {
-            // It's possible compressor used token optimization; still check
-            // If mismatch, just write what we have
+    codec.params.window_size = size_t(1) << hdr.window_log;
+    codec.format = hdr.format;
+    auto read_history = [history_file](u64 at, u8* dst, size_t len) {
+        if (seek64(history_file, at, SEEK_SET) != 0 || fread(dst, 1, len, history_file) != len) throw runtime_error("cannot read back output");
+        seek64(history_file, 0, SEEK_END);
+    };
+    if (seek64(f, start, SEEK_SET) != 0) throw runtime_error("cannot seek input");
+    const vector<u8>* base = (hdr.flags & flag_dict) ? &dict->content : nullptr;
+
+    // A reader thread hands chunks to the pool as it reads them; this thread
+    // writes the results back in file order. Linked chunks wait in their task
+    // for the chunk before them. Long matches read earlier output back from the
+    // file, so they are spliced in here, in order.
+    unsigned int hw = thread::hardware_concurrency(); if (hw == 0) hw = 2;
+    ThreadPool pool(hw);
+    struct Pending { u64 orig; shared_future<DecodedChunk> result; };
+    deque<Pending> pending;
+    const size_t max_pending = 2 * (size_t)hw + 2; // bounds the memory held by chunks in flight
+    mutex qm;
+    condition_variable qcv;
+    bool reader_done = false, abort = false;
+    exception_ptr read_error;
+
+    thread reader([&]() {
+        try {
+            shared_future<DecodedChunk> prev;
+            u64 pos = start;
+            for (u32 i = 0; i < count; ++i) {
+                {
+                    unique_lock<mutex> lk(qm);
+                    qcv.wait(lk, [&]{ return abort || pending.size() < max_pending; });
+                    if (abort) break;
+                }
+                u64 orig, comp;
+                if (fread(&orig, sizeof(u64), 1, f) != 1) throw runtime_error("bad file");
+                if (fread(&comp, sizeof(u64), 1, f) != 1) throw runtime_error("bad file");
+                if (orig > (u64(1) << 31)) throw runtime_error("bad chunk size");
+                if (expect && orig != expect[i].orig) throw runtime_error("bad seek table");
+                // checked before allocating: a corrupt size must not reserve gigabytes
+                if (pos + 16 > end || comp > end - pos - 16) throw runtime_error("bad chunk size");
+                pos += 16 + comp;
+                vector<u8> compbuf; compbuf.resize((size_t)comp);
+                if (comp && fread(compbuf.data(), 1, (size_t)comp, f) != comp) throw runtime_error("bad file read");
+                // a range of a linked file always starts at chunk 0
+                bool linked = (hdr.flags & flag_linked) && i > 0;
+                auto task = [&codec, &hdr, base, linked, prev, orig, compbuf = move(compbuf)]() mutable -> DecodedChunk {
+                    return decode_chunk(codec, hdr, compbuf, (size_t)orig, linked ? prev.get().lz.get() : base);
+                };
+                prev = pool.enqueue(move(task)).share();
+                {
+                    lock_guard<mutex> lk(qm);
+                    pending.push_back({orig, prev});
+                }
+                qcv.notify_all();
+            }
+        } catch (...) {
+            lock_guard<mutex> lk(qm);
+            read_error = current_exception();
+        }
+        {
+            lock_guard<mutex> lk(qm);
+            reader_done = true;
+        }
+        qcv.notify_all();
+    });
+
+    u64 written = first_base, out_bytes = 0;
+    try {
+        while (true) {
+            Pending p;
+            {
+                unique_lock<mutex> lk(qm);
+                qcv.wait(lk, [&]{ return reader_done || !pending.empty(); });
+                if (pending.empty()) break;
+                p = move(pending.front());
+                pending.pop_front();
+            }
+            qcv.notify_all();
+            const DecodedChunk& c = p.result.get();
+            const vector<u8>* data = c.data.get();
+            vector<u8> full;
+            if (hdr.flags & flag_long) {
+                full = splice_long_matches(*data, c.long_matches, written, p.orig, read_history);
+                if (full.size() != p.orig) throw runtime_error("chunk size mismatch");
+                data = &full;
+            }
+            if (history_file && history_file != out && !data->empty()) fwrite(data->data(), 1, data->size(), history_file);
+            u64 lo = max(from, written), hi = min(to, written + data->size());
+            if (lo < hi) out_bytes += fwrite(data->data() + (lo - written), 1, (size_t)(hi - lo), out);
+            written += data->size();
+        }
+    } catch (...) {
+        {
+            lock_guard<mutex> lk(qm);
+            abort = true;
+        }
+        qcv.notify_all();
+        reader.join();
+        throw;
+    }
+    reader.join();
+    if (read_error) rethrow_exception(read_error);
+    return out_bytes;
+}
+
+// dict may be null when the file was compressed without one.
+static void read_and_decompress_file(const string& inname, const string& outname, const Dictionary* dict) {
+    FILE* f = fopen(inname.c_str(), "rb");
+    if (!f) throw runtime_error("cannot open input file");
+    FILE* out = nullptr;
+    try {
+        u32 cnt;
+        ContainerHeader hdr = read_header(f, dict, cnt);
+        u64 start = tell64(f), end = records_end(f, hdr, cnt);
+        // long-range matches copy from earlier output, so read it back from the file
+        out = fopen(outname.c_str(), (hdr.flags & flag_long) ? "w+b" : "wb");
+        if (!out) throw runtime_error("cannot open output file");
+        decode_chunks(f, hdr, dict, start, end, cnt, 0, 0, UINT64_MAX, out, (hdr.flags & flag_long) ? out : nullptr, nullptr);
+    } catch (...) {
+        if (out) fclose(out);
+        fclose(f);
+        throw;
+    }
+    fclose(out);
+    fclose(f);
+}
+
+// Writes bytes [offset, offset + length) of the original file to outname and
+// returns how many there were. Only the chunks covering the range are read,
+// except in linked and long files, whose chunks depend on everything before
+// them: those are decoded from the first chunk on, writing just the range.
+static u64 extract_range(const string& inname, const string& outname, const Dictionary* dict, u64 offset, u64 length) {
+    FILE* f = fopen(inname.c_str(), "rb");
+    if (!f) throw runtime_error("cannot open input file");
+    FILE* out = nullptr;
+    FILE* scratch = nullptr;
+    u64 extracted = 0;
+    try {
+        u32 cnt;
+        ContainerHeader hdr = read_header(f, dict, cnt);
+        vector<ChunkEntry> index = read_chunk_index(f, hdr, cnt, tell64(f));
+        u64 total = 0;
+        for (const ChunkEntry& e : index) total += e.orig;
+        u64 from = min(offset, total), to = from + min(length, total - from);
+        out = fopen(outname.c_str(), "wb");
+        if (!out) throw runtime_error("cannot open output file");
+        if (from < to) {
+            // chunks [first, last] hold the range; base is where first starts
+            size_t first = 0;
+            u64 base = 0;
+            while (base + index[first].orig <= from) base += index[first++].orig;
+            size_t last = first;
+            for (u64 end = base + index[first].orig; end < to; ) end += index[++last].orig;
+            if (hdr.flags & (flag_linked | flag_long)) { first = 0; base = 0; }
+            if (hdr.flags & flag_long) {
+                scratch = tmpfile();
+                if (!scratch) throw runtime_error("cannot create scratch file");
+            }
+            extracted = decode_chunks(f, hdr, dict, index[first].pos, records_end(f, hdr, cnt), u32(last - first + 1), base, from, to, out, scratch, &index[first]);
         }
-        if (!decomp.empty()) fwrite(decomp.data(), 1, decomp.size(), out);
+    } catch (...) {
+        if (scratch) fclose(scratch);
+        if (out) fclose(out);
+        fclose(f);
+        throw;
     }
+    if (scratch) fclose(scratch);
     fclose(out);
     fclose(f);
+    return extracted;
+}
+
+// ---------------------- Random access ----------------------
+// pread-style reads from a compressed file for serving data without
+// unpacking it. Decoded chunks stay in an LRU cache within a byte budget.
+// Misses are decoded on a ThreadPool: the chunks a read needs go to the
+// front of its queue, readahead of the following chunks to the back. At most
+// `readahead` chunks are decoded ahead: finished ones join the LRU, and ones
+// still pending when reads move elsewhere are cancelled. Pool
+// tasks never wait for each other; a linked chunk is only queued once its
+// predecessor's LZ77 output is at hand, and long matches are spliced in by
+// the reading thread, once the chunks they copy from are complete.
+class MtcReader {
+public:
+    // dict may be null when the file was compressed without one.
+    MtcReader(const string& filename, const Dictionary* dict = nullptr,
+              size_t cache_bytes = size_t(256) << 20, size_t readahead_chunks = 2)
+        : budget(cache_bytes), readahead(readahead_chunks), pool(workers()) {
+        f = fopen(filename.c_str(), "rb");
+        if (!f) throw runtime_error("cannot open input file");
+        try {
+            u32 cnt;
+            hdr = read_header(f, dict, cnt);
+            index = read_chunk_index(f, hdr, cnt, tell64(f));
+            end = records_end(f, hdr, cnt);
+        } catch (...) { fclose(f); throw; }
+        if (hdr.flags & flag_dict) history = make_shared<const vector<u8>>(dict->content);
+        codec.params.window_size = size_t(1) << hdr.window_log;
+        codec.format = hdr.format;
+        starts.reserve(index.size());
+        for (const ChunkEntry& e : index) { starts.push_back(total); total += e.orig; }
+    }
+    ~MtcReader() { fclose(f); }
+    MtcReader(const MtcReader&) = delete;
+    MtcReader& operator=(const MtcReader&) = delete;
+
+    // Size of the original file.
+    u64 size() const { return total; }
+
+    // Copies up to len bytes at offset of the original file into dst and
+    // returns how many there were (fewer only at the end of the file).
+    size_t pread(u8* dst, size_t len, u64 offset) {
+        unique_lock<mutex> lk(m);
+        return read_locked(lk, dst, len, offset);
+    }
+
+private:
+    struct Cached {
+        shared_ptr<const vector<u8>> data; // the chunk as in the original file
+        shared_ptr<const vector<u8>> lz;   // LZ77 output, history of the next linked chunk
+        list<size_t>::iterator age;
+    };
+    struct Pending {
+        shared_future<DecodedChunk> fut;
+        shared_ptr<atomic<bool>> cancel; // set: the task skips decoding
+        bool ahead = false;              // readahead no read is waiting for yet
+    };
+
+    static unsigned workers() { unsigned hw = thread::hardware_concurrency(); return hw ? hw : 2; }
+
+    size_t chunk_at(u64 offset) const { return size_t(upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1; }
+    bool linked() const { return (hdr.flags & flag_linked) != 0; }
+
+    // lk holds m; it is released while waiting for a decode, so reads served
+    // from the cache go on meanwhile.
+    size_t read_locked(unique_lock<mutex>& lk, u8* dst, size_t len, u64 offset) {
+        if (offset >= total || len == 0) return 0;
+        len = (size_t)min<u64>(len, total - offset);
+        size_t first = chunk_at(offset), last = chunk_at(offset + len - 1);
+        // queue every chunk of the read at once, so they decode in parallel;
+        // urgent tasks go to the front, so the last is queued first and the
+        // first, waited on first, ends up at the head
+        if (!linked())
+            for (size_t k = last + 1; k-- > first; )
+                if (!cache.count(k) && !inflight.count(k)) submit(k, nullptr, true);
+        size_t copied = 0;
+        for (size_t k = first; k <= last; ++k) {
+            shared_ptr<const vector<u8>> data = get(lk, k).data;
+            u64 lo = max<u64>(offset, starts[k]), hi = min<u64>(offset + len, starts[k] + data->size());
+            if (lo < hi) memcpy(dst + (lo - offset), data->data() + (lo - starts[k]), (size_t)(hi - lo));
+            copied += (size_t)(hi > lo ? hi - lo : 0);
+        }
+        prefetch(lk, last + 1);
+        return copied;
+    }
+
+    // Reads compressed chunk k and queues its decoding; prev_lz is the LZ77
+    // output of chunk k-1 for linked files.
+    void submit(size_t k, shared_ptr<const vector<u8>> prev_lz, bool urgent) {
+        u64 orig, comp;
+        if (seek64(f, index[k].pos, SEEK_SET) != 0 || fread(&orig, sizeof(u64), 1, f) != 1 || fread(&comp, sizeof(u64), 1, f) != 1)
+            throw runtime_error("bad file");
+        if (orig > (u64(1) << 31)) throw runtime_error("bad chunk size");
+        // starts[] comes from the index, so the record must agree with it
+        if (orig != index[k].orig) throw runtime_error("bad seek table");
+        if (comp > end - index[k].pos - 16) throw runtime_error("bad chunk size");
+        vector<u8> compbuf((size_t)comp);
+        if (comp && fread(compbuf.data(), 1, (size_t)comp, f) != comp) throw runtime_error("bad file read");
+        shared_ptr<const vector<u8>> hist = (linked() && k > 0) ? prev_lz : history;
+        auto cancel = make_shared<atomic<bool>>(false);
+        if (!urgent) ++ahead_queued;
+        auto task = [this, orig, hist, cancel, urgent, compbuf = move(compbuf)]() mutable -> DecodedChunk {
+            if (!urgent) --ahead_queued;
+            if (*cancel) return {};
+            return decode_chunk(codec, hdr, compbuf, (size_t)orig, hist.get());
+        };
+        inflight[k] = {pool.enqueue(move(task), urgent).share(), cancel, !urgent};
+    }
+
+    // Chunk k from the cache, or decoded now.
+    Cached get(unique_lock<mutex>& lk, size_t k) {
+        auto it = cache.find(k);
+        if (it != cache.end()) {
+            lru.splice(lru.begin(), lru, it->second.age);
+            return it->second;
+        }
+        if (!inflight.count(k) && linked() && k > 0) {
+            // decode forward from the nearest chunk whose predecessor is cached
+            size_t j = k;
+            while (j > 0 && !cache.count(j - 1)) --j;
+            shared_ptr<const vector<u8>> prev_lz = j > 0 ? cache[j - 1].lz : nullptr;
+            for (size_t t = j; t < k; ++t) prev_lz = finish(lk, t, prev_lz).lz;
+            if (!cache.count(k) && !inflight.count(k)) submit(k, prev_lz, true);
+        }
+        return finish(lk, k, nullptr);
+    }
+
+    // Waits for chunk k (queued now if it is not yet), completes it and
+    // caches it. Another reader may complete k while lk is released; its
+    // entry is used then.
+    Cached finish(unique_lock<mutex>& lk, size_t k, shared_ptr<const vector<u8>> prev_lz) {
+        if (hdr.flags & flag_long) return finish_long(lk, k, prev_lz);
+        auto c = cache.find(k);
+        if (c != cache.end()) return c->second;
+        Pending p = wait(lk, k, prev_lz);
+        if ((c = cache.find(k)) != cache.end()) return c->second;
+        const DecodedChunk& d = p.fut.get();
+        return store(k, p, d.data, d.lz);
+    }
+
+    // finish() for files with long matches. A chunk's long matches copy from
+    // earlier chunks, which may have long matches of their own, so the chunks
+    // are finished from an explicit stack: the sources a chunk is missing are
+    // pushed on top of it and finished first, smallest first. Sources stay
+    // pinned until every chunk on the stack that copies from them is spliced,
+    // whatever the cache evicts meanwhile.
+    Cached finish_long(unique_lock<mutex>& lk, size_t k, shared_ptr<const vector<u8>> prev_lz) {
+        struct Frame {
+            size_t k;
+            shared_ptr<const vector<u8>> prev_lz; // linked: LZ77 output of chunk k-1, when at hand
+            Pending p;
+            bool decoded = false;
+            bool counted = false;                 // sources are counted in need
+            vector<size_t> sources;
+            Frame(size_t k, shared_ptr<const vector<u8>> prev_lz) : k(k), prev_lz(move(prev_lz)) {}
+        };
+        unordered_map<size_t, shared_ptr<const vector<u8>>> pins;
+        unordered_map<size_t, size_t> need; // frames waiting for each chunk
+        vector<Frame> stack;
+        stack.emplace_back(k, prev_lz);
+        Cached result;
+        // the top frame is complete with entry e: release its sources and
+        // pin it for the frames below that copy from it
+        auto pop = [&](const Cached& e) {
+            Frame& t = stack.back();
+            if (t.counted)
+                for (size_t j : t.sources)
+                    if (--need[j] == 0) { need.erase(j); pins.erase(j); }
+            if (need.count(t.k)) pins[t.k] = e.data;
+            if (stack.size() == 1) result = e;
+            stack.pop_back();
+        };
+        while (!stack.empty()) {
+            size_t i = stack.size() - 1;
+            auto c = cache.find(stack[i].k);
+            if (c != cache.end()) { pop(c->second); continue; }
+            if (!stack[i].decoded) {
+                size_t t = stack[i].k;
+                if (!inflight.count(t) && linked() && t > 0 && !stack[i].prev_lz) {
+                    auto prev = cache.find(t - 1);
+                    if (prev == cache.end()) { stack.emplace_back(t - 1, nullptr); continue; }
+                    stack[i].prev_lz = prev->second.lz;
+                }
+                Pending p = wait(lk, t, stack[i].prev_lz);
+                stack[i].p = p;
+                stack[i].decoded = true;
+                continue; // another reader may have completed it meanwhile
+            }
+            const DecodedChunk& d = stack[i].p.fut.get();
+            if (!stack[i].counted) {
+                stack[i].sources = long_sources(stack[i].k, d.long_matches);
+                stack[i].counted = true;
+                for (size_t j : stack[i].sources) {
+                    ++need[j];
+                    if (pins.count(j)) continue;
+                    auto src = cache.find(j);
+                    if (src != cache.end()) pins[j] = src->second.data;
+                }
+            }
+            // pushed largest first, so the smallest is finished first
+            size_t depth = stack.size();
+            for (size_t n = stack[i].sources.size(); n-- > 0; ) {
+                size_t j = stack[i].sources[n];
+                if (!pins.count(j)) stack.emplace_back(j, nullptr);
+            }
+            if (stack.size() != depth) continue;
+            Frame& t = stack[i];
+            auto read_history = [this, &pins](u64 at, u8* dst, size_t len) {
+                while (len) {
+                    auto it = pins.find(chunk_at(at));
+                    if (it == pins.end()) throw runtime_error("corrupt long match");
+                    u64 base = starts[it->first];
+                    size_t n = (size_t)min<u64>(len, base + it->second->size() - at);
+                    if (n == 0) throw runtime_error("corrupt long match");
+                    memcpy(dst, it->second->data() + (at - base), n);
+                    dst += n; at += n; len -= n;
+                }
+            };
+            auto data = make_shared<const vector<u8>>(splice_long_matches(*d.data, d.long_matches, starts[t.k], index[t.k].orig, read_history));
+            if (data->size() != index[t.k].orig) throw runtime_error("chunk size mismatch");
+            pop(store(t.k, t.p, data, d.lz));
+        }
+        return result;
+    }
+
+    // The chunks before k that k's long matches copy from, ascending.
+    // Matches that do not fit are left to splice_long_matches to reject.
+    vector<size_t> long_sources(size_t k, const vector<LongMatch>& matches) const {
+        vector<size_t> sources;
+        for (const LongMatch& m : matches) {
+            u64 here = starts[k] + m.pos;
+            if (m.dist == 0 || m.dist > here || here - m.dist >= starts[k]) continue;
+            u64 src = here - m.dist, end = min<u64>(src + m.len, starts[k]);
+            for (size_t j = chunk_at(src); j < k && starts[j] < end; ++j) sources.push_back(j);
+        }
+        sort(sources.begin(), sources.end());
+        sources.erase(unique(sources.begin(), sources.end()), sources.end());
+        return sources;
+    }
+
+    // Queues chunk k unless it is in flight and waits for it with lk released.
+    // k stays in flight until cached, so other reads do not queue it again.
+    Pending wait(unique_lock<mutex>& lk, size_t k, shared_ptr<const vector<u8>> prev_lz) {
+        if (!inflight.count(k)) submit(k, prev_lz, true);
+        Pending p = inflight[k];
+        inflight[k].ahead = false;
+        lk.unlock();
+        p.fut.wait();
+        lk.lock();
+        return p;
+    }
+
+    // Caches chunk k, decoded by the task of p, and evicts down to the budget.
+    Cached store(size_t k, const Pending& p, shared_ptr<const vector<u8>> data, shared_ptr<const vector<u8>> lz) {
+        // k may have been completed, evicted and queued anew meanwhile
+        auto it = inflight.find(k);
+        if (it != inflight.end() && it->second.cancel == p.cancel) inflight.erase(it);
+        lru.push_front(k);
+        Cached& e = cache[k];
+        e = {data, lz, lru.begin()};
+        cached_bytes += bytes(e);
+        // the newest entry stays even if it alone is over budget
+        while (cached_bytes > budget && lru.size() > 1) {
+            auto old = cache.find(lru.back());
+            cached_bytes -= bytes(old->second);
+            cache.erase(old);
+            lru.pop_back();
+        }
+        return e;
+    }
+
+    static size_t bytes(const Cached& e) {
+        return e.data->size() + (e.lz && e.lz != e.data ? e.lz->size() : 0);
+    }
+
+    // Queues the chunks after a read; a linked chunk only when the one before
+    // it is decoded. Finished readahead is moved into the cache first, and
+    // pending readahead outside [from, from + readahead) is cancelled.
+    void prefetch(unique_lock<mutex>& lk, size_t from) {
+        vector<size_t> ahead;
+        for (const auto& e : inflight) if (e.second.ahead) ahead.push_back(e.first);
+        sort(ahead.begin(), ahead.end());
+        for (size_t k : ahead) {
+            auto it = inflight.find(k);
+            if (it == inflight.end() || !it->second.ahead) continue;
+            if (it->second.fut.wait_for(chrono::seconds(0)) == future_status::ready) {
+                // a chunk that fails to decode is retried, and reports, when it is read
+                try { finish(lk, k, nullptr); } catch (exception&) { inflight.erase(k); }
+            } else if (k < from || k >= from + readahead) {
+                *it->second.cancel = true;
+                inflight.erase(it);
+            }
+        }
+        for (size_t k = from; k < index.size() && k < from + readahead; ++k) {
+            if (cache.count(k) || inflight.count(k)) continue;
+            // cancelled readahead keeps its place in the pool's queue until
+            // a worker gets to it; do not let a backlog of it build up
+            if (ahead_queued >= readahead) return;
+            if (linked() && k > 0) {
+                auto prev = cache.find(k - 1);
+                if (prev == cache.end()) return;
+                submit(k, prev->second.lz, false);
+            } else {
+                submit(k, nullptr, false);
+            }
+        }
+    }
+
+    FILE* f = nullptr;
+    ContainerHeader hdr;
+    LZ77 codec;
+    shared_ptr<const vector<u8>> history; // the dictionary, if any
+    vector<ChunkEntry> index;
+    vector<u64> starts;                    // offset of each chunk in the original file
+    u64 end = 0;                           // records_end: bounds compressed chunk sizes
+    u64 total = 0;
+    size_t budget, readahead;
+    size_t cached_bytes = 0;
+    atomic<size_t> ahead_queued{0};        // readahead tasks not yet started by the pool
+    list<size_t> lru;                      // most recently used first
+    unordered_map<size_t, Cached> cache;
+    unordered_map<size_t, Pending> inflight;
+    mutex m;
+    ThreadPool pool;                       // last: destroyed first, before what its tasks use
+};
+
+// extract_range through an MtcReader (x --reader), one chunk-sized pread
+// at a time, for checking the reader against the streaming decoder.
+static u64 read_range(const string& inname, const string& outname, const Dictionary* dict, u64 offset, u64 length) {
+    MtcReader reader(inname, dict);
+    u64 from = min(offset, reader.size()), to = from + min(length, reader.size() - from);
+    FILE* out = fopen(outname.c_str(), "wb");
+    if (!out) throw runtime_error("cannot open output file");
+    vector<u8> buf(size_t(1) << 20);
+    u64 at = from;
+    try {
+        while (at < to) {
+            size_t n = reader.pread(buf.data(), (size_t)min<u64>(buf.size(), to - at), at);
+            if (n == 0) throw runtime_error("short read");
+            if (fwrite(buf.data(), 1, n, out) != n) throw runtime_error("write error");
+            at += n;
+        }
+    } catch (...) { fclose(out); throw; }
+    fclose(out);
+    return at - from;
 }
 
 // ---------------------- Main compressor flow ----------------------
@@ -201,8 +3041,10 @@ int main(int argc, char** argv) {
 
     if (argc < 3) {
         cerr << "Usage:\n";
-        cerr << "  To compress:   " << argv[0] << " c <input-file> <output-file> [chunk_size_bytes]\n";
-        cerr << "  To decompress: " << argv[0] << " d <input-file> <output-file>\n";
+        cerr << "  To compress:   " << argv[0] << " c <input-file> <output-file> [chunk_size_bytes] [-1..-19] [--window=<log2>] [--linked] [--long[=<log2>]] [--format=bitmap|sequence|flag] [--no-entropy] [--dict=<file>] [--filter=x86|delta:<stride>|shuffle:<size>]...\n";
+        cerr << "  To decompress: " << argv[0] << " d <input-file> <output-file> [--dict=<file>]\n";
+        cerr << "  To extract:    " << argv[0] << " x <input-file> <output-file> <offset> <length> [--dict=<file>] [--reader]\n";
+        cerr << "  To train:      " << argv[0] << " train <dictionary-file> <sample-file>... [--size=<bytes>]\n";
         return 1;
     }
 
@@ -210,21 +3052,151 @@ int main(int argc, char** argv) {
     if (mode == "d" || mode == "D") {
         if (argc < 4) { cerr << "missing file args for decompress\n"; return 1; }
         string in = argv[2], out = argv[3];
-        try { read_and_decompress_file(in, out); cout << "Decompression done.\n"; }
+        try {
+            Dictionary dict;
+            bool with_dict = false;
+            for (int a = 4; a < argc; ++a) {
+                string arg = argv[a];
+                if (arg.rfind("--dict=", 0) == 0) { dict = load_dictionary(arg.substr(7)); with_dict = true; }
+                else { cerr << "unknown option " << arg << "\n"; return 1; }
+            }
+            read_and_decompress_file(in, out, with_dict ? &dict : nullptr);
+            cout << "Decompression done.\n";
+        }
+        catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+        return 0;
+    }
+
+    if (mode == "x" || mode == "X") {
+        if (argc < 6) { cerr << "missing args for extract\n"; return 1; }
+        string in = argv[2], out = argv[3];
+        try {
+            u64 offset = parse_number(argv[4], "offset"), length = parse_number(argv[5], "length");
+            Dictionary dict;
+            bool with_dict = false, with_reader = false;
+            for (int a = 6; a < argc; ++a) {
+                string arg = argv[a];
+                if (arg.rfind("--dict=", 0) == 0) { dict = load_dictionary(arg.substr(7)); with_dict = true; }
+                else if (arg == "--reader") with_reader = true;
+                else { cerr << "unknown option " << arg << "\n"; return 1; }
+            }
+            u64 n = with_reader ? read_range(in, out, with_dict ? &dict : nullptr, offset, length)
+                                : extract_range(in, out, with_dict ? &dict : nullptr, offset, length);
+            cout << "Extracted " << n << " bytes.\n";
+        }
         catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
         return 0;
     }
 
+    if (mode == "train") {
+        if (argc < 4) { cerr << "missing file args for train\n"; return 1; }
+        string dictname = argv[2];
+        size_t dict_size = default_dict_size;
+        vector<vector<u8>> samples;
+        for (int a = 3; a < argc; ++a) {
+            string arg = argv[a];
+            if (arg.rfind("--size=", 0) == 0) {
+                try { dict_size = (size_t)parse_number(arg.substr(7), "dictionary size"); }
+                catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+                continue;
+            }
+            u64 size = file_size(arg);
+            if (size == 0) continue;
+            if (size > (u64(1) << 31)) { cerr << "sample too large: " << arg << "\n"; return 1; }
+            samples.push_back(read_file_chunk(arg, 0, (size_t)size));
+        }
+        if (samples.empty()) { cerr << "no readable samples\n"; return 1; }
+        try {
+            Dictionary dict;
+            dict.content = train_dictionary(samples, dict_size);
+            dict.id = dictionary_id(dict.content);
+            save_dictionary(dictname, dict);
+            cout << "Dictionary " << hex << setw(8) << setfill('0') << dict.id << dec << ": "
+                 << dict.content.size() << " bytes from " << samples.size() << " samples\n";
+        } catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+        return 0;
+    }
+
     if (mode != "c" && mode != "C") { cerr << "unknown mode\n"; return 1; }
     string inname = argv[2];
     string outname = argv[3];
     size_t chunk_size = 1 << 20; // default 1MB
-    if (argc >= 5) chunk_size = stoull(argv[4]);
+    int level = default_level;
+    int window_log = 0; // 0: level default
+    bool linked = false;
+    int long_log = 0; // 0: no long-range matching
+    TokenFormat format = TokenFormat::Bitmap;
+    bool entropy = true;
+    string dict_name;
+    vector<Filter> filters;
+    for (int a = 4; a < argc; ++a) {
+        string arg = argv[a];
+        u64 v = 0;
+        if (arg.size() > 1 && arg[0] == '-' && isdigit((unsigned char)arg[1])) {
+            try { v = parse_number(arg.substr(1), "level"); }
+            catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+            if (v < (u64)min_level || v > (u64)max_level) { cerr << "level must be between " << min_level << " and " << max_level << "\n"; return 1; }
+            level = (int)v;
+        } else if (arg.rfind("--window=", 0) == 0) {
+            try { v = parse_number(arg.substr(9), "window"); }
+            catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+            if (v < (u64)min_window_log || v > (u64)max_window_log) { cerr << "window must be between 2^" << min_window_log << " and 2^" << max_window_log << "\n"; return 1; }
+            window_log = (int)v;
+        }
+        else if (arg == "--linked") linked = true;
+        else if (arg == "--no-entropy") entropy = false;
+        else if (arg.rfind("--dict=", 0) == 0) dict_name = arg.substr(7);
+        else if (arg.rfind("--filter=", 0) == 0) {
+            try { filters.push_back(parse_filter(arg.substr(9))); }
+            catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+            if (filters.size() > max_filters) { cerr << "at most " << max_filters << " filters\n"; return 1; }
+        }
+        else if (arg == "--format=bitmap") format = TokenFormat::Bitmap;
+        else if (arg == "--format=sequence") format = TokenFormat::Sequence;
+        else if (arg == "--format=flag") format = TokenFormat::Flag;
+        else if (arg == "--long") long_log = default_long_log;
+        else if (arg.rfind("--long=", 0) == 0) {
+            try { v = parse_number(arg.substr(7), "long window"); }
+            catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+            if (v < (u64)min_window_log || v > (u64)max_window_log) { cerr << "long window must be between 2^" << min_window_log << " and 2^" << max_window_log << "\n"; return 1; }
+            long_log = (int)v;
+        }
+        else if (is_number(arg)) {
+            // over 19 digits is over the limit below either way
+            chunk_size = arg.size() > 19 ? SIZE_MAX : (size_t)stoull(arg);
+        }
+        else { cerr << "unknown option " << arg << "\n"; return 1; }
+    }
+    if (chunk_size == 0 || chunk_size > (size_t(1) << 31)) { cerr << "chunk size must be between 1 byte and 2 GB\n"; return 1; }
+    LZ77 codec; // settings copied into every chunk task
+    codec.params = level_params(level);
+    if (window_log) codec.params.window_size = size_t(1) << window_log;
+    codec.format = format;
+    codec.entropy = entropy;
+    ContainerHeader hdr;
+    hdr.format = format;
+    hdr.window_log = min_window_log;
+    while ((size_t(1) << hdr.window_log) < codec.params.window_size) ++hdr.window_log;
+    if (linked) hdr.flags |= flag_linked;
+    if (long_log) hdr.flags |= flag_long;
+    if (!filters.empty()) hdr.flags |= flag_filters;
+    hdr.filters = filters;
+    shared_ptr<const vector<u8>> dict_content;
+    if (!dict_name.empty()) {
+        try {
+            Dictionary dict = load_dictionary(dict_name);
+            hdr.flags |= flag_dict;
+            hdr.dict_id = dict.id;
+            dict_content = make_shared<const vector<u8>>(move(dict.content));
+        } catch (exception &e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+    }
 
     u64 fsize = file_size(inname);
     if (fsize == 0) { cerr << "cannot read input or file empty\n"; return 1; }
     size_t num_chunks = (size_t)((fsize + chunk_size - 1) / chunk_size);
-    cout << "Input size: " << fsize << " bytes; chunks: " << num_chunks << " (" << chunk_size << " bytes each)\n";
+    // a single chunk is found without an index; small files keep the bytes
+    if (num_chunks > 1) hdr.flags |= flag_seek_table;
+    cout << "Input size: " << fsize << " bytes; chunks: " << num_chunks << " (" << chunk_size << " bytes each); level " << level << "\n";
 
     // prepare threadpool
     unsigned int hw = thread::hardware_concurrency(); if (hw == 0) hw = 2;
@@ -232,20 +3204,44 @@ int main(int argc, char** argv) {
     cout << "Using " << hw << " worker threads.\n";
 
     vector<future<pair<size_t, vector<u8>>>> futures; futures.reserve(num_chunks);
-    LZ77 codec; // local codec for main thread; each task will construct its own codec as needed
+    shared_ptr<const vector<u8>> prev_chunk;
+    LongRangeMatcher ldm; // runs here, in file order; workers get the residuals
+    if (long_log) ldm.reset(long_log, fsize, chunk_size);
 
     for (size_t i = 0; i < num_chunks; ++i) {
         u64 offset = (u64)i * chunk_size;
         size_t read_sz = (size_t)min<u64>(chunk_size, (u64)fsize - offset);
         // read chunk into memory
-        vector<u8> chunk = read_file_chunk(inname, offset, read_sz);
-        if (chunk.empty() && read_sz != 0) { cerr << "Failed to read chunk "<<i<<"\n"; return 1; }
-        // move into task
-        auto task = [i, chunk = move(chunk)]() -> pair<size_t, vector<u8>> {
-            LZ77 localcodec;
-            auto comp = localcodec.compress(chunk);
+        auto chunk = make_shared<const vector<u8>>(read_file_chunk(inname, offset, read_sz));
+        if (chunk->empty() && read_sz != 0) { cerr << "Failed to read chunk "<<i<<"\n"; return 1; }
+        vector<LongMatch> long_matches;
+        if (long_log) {
+            vector<u8> residual;
+            ldm.process(*chunk, long_matches, residual);
+            chunk = make_shared<const vector<u8>>(move(residual));
+        }
+        // linked chunks also see the previous chunk (read-only) as window history,
+        // the others start from the dictionary if there is one
+        shared_ptr<const vector<u8>> history = (linked && prev_chunk) ? prev_chunk : dict_content;
+        bool with_long = long_log != 0;
+        // filters run in the task too; a linked history is filtered again there,
+        // since the decoder sees the previous chunk in filtered form
+        bool filter_history = linked && prev_chunk && !filters.empty();
+        auto task = [i, chunk, history, codec, with_long, filters, filter_history, long_matches = move(long_matches)]() -> pair<size_t, vector<u8>> {
+            LZ77 localcodec = codec;
+            vector<u8> comp;
+            if (with_long) put_long_matches(comp, long_matches);
+            const vector<u8>* src = chunk.get();
+            const vector<u8>* hist = history.get();
+            vector<u8> filtered, filtered_hist;
+            if (!filters.empty()) { filtered = *chunk; apply_filters(filters, filtered); src = &filtered; }
+            if (filter_history) { filtered_hist = *history; apply_filters(filters, filtered_hist); hist = &filtered_hist; }
+            auto lz = hist ? localcodec.compress(*src, hist->data(), hist->size())
+                           : localcodec.compress(*src);
+            comp.insert(comp.end(), lz.begin(), lz.end());
             return {i, move(comp)};
         };
+        prev_chunk = chunk;
         futures.push_back(pool.enqueue(task));
     }
 
@@ -262,7 +3258,7 @@ int main(int argc, char** argv) {
 
     // write combined file
     try {
-        write_all(outname, compressed_chunks, original_sizes);
+        write_all(outname, hdr, compressed_chunks, original_sizes);
         cout << "Compression finished. Output: " << outname << "\n";
     } catch (exception &e) {
         cerr << "Failed to write output: " << e.what() << "\n"; return 1;